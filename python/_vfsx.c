@@ -0,0 +1,680 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is VFSX (Samba VFS External Bridge).
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * _vfsx - accelerated message dispatch for the VFSX Python handler
+ * Frames module messages out of a receive buffer, decodes them, calls the
+ * session method and formats the replies, all without going through the
+ * interpreter for each message.  vfsx.py falls back to its pure Python
+ * dispatch when this module is not built.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VFSX_MSG_OUT_SIZE 512
+#define VFSX_MSG_IN_SIZE 3
+#define VFSX_FAIL_ERROR -1
+#define VFSX_SUCCESS_TRANSPARENT 0
+#define VFSX_MAX_ARGS 16
+#define VFSX_HINTS_MAX 255
+
+typedef struct {
+	PyObject_HEAD
+	Py_ssize_t id_size;		/* request ID in front of each message */
+	PyObject *sessions;		/* origpath -> session */
+	PyObject *get_session;		/* VFSModuleSession.getSession */
+	PyObject *remove_session;	/* VFSModuleSession.removeSession */
+	PyObject *on_error;		/* called with sys.exc_info() */
+	PyObject *log_debug;		/* called with each message when debugging */
+	PyObject *on_gap;		/* called with (origpath, pid, first, last) or None */
+	PyObject *sequence;		/* pid -> last sequence number seen, may be shared */
+	PyObject *disconnect_name;
+	PyObject *default_name;
+	PyObject *status_name;
+	PyObject *hints_name;
+} Dispatcher;
+
+static void Dispatcher_dealloc(Dispatcher *self)
+{
+	Py_XDECREF(self->sessions);
+	Py_XDECREF(self->get_session);
+	Py_XDECREF(self->remove_session);
+	Py_XDECREF(self->on_error);
+	Py_XDECREF(self->log_debug);
+	Py_XDECREF(self->on_gap);
+	Py_XDECREF(self->sequence);
+	Py_XDECREF(self->disconnect_name);
+	Py_XDECREF(self->default_name);
+	Py_XDECREF(self->status_name);
+	Py_XDECREF(self->hints_name);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int Dispatcher_init(Dispatcher *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = { "id_size", "sessions", "get_session", "remove_session",
+				  "on_error", "log_debug", "on_gap", "sequence", NULL };
+	PyObject *sessions, *get_session, *remove_session, *on_error, *log_debug;
+	PyObject *on_gap = Py_None;
+	PyObject *sequence = NULL;
+	Py_ssize_t id_size;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "nO!OOOO|OO!", kwlist, &id_size,
+					 &PyDict_Type, &sessions, &get_session,
+					 &remove_session, &on_error, &log_debug, &on_gap,
+					 &PyDict_Type, &sequence)) {
+		return -1;
+	}
+	if (id_size < 0) {
+		PyErr_SetString(PyExc_ValueError, "id_size must not be negative");
+		return -1;
+	}
+	self->id_size = id_size;
+	Py_INCREF(sessions);
+	Py_INCREF(get_session);
+	Py_INCREF(remove_session);
+	Py_INCREF(on_error);
+	Py_INCREF(log_debug);
+	Py_INCREF(on_gap);
+	Py_XSETREF(self->sessions, sessions);
+	Py_XSETREF(self->get_session, get_session);
+	Py_XSETREF(self->remove_session, remove_session);
+	Py_XSETREF(self->on_error, on_error);
+	Py_XSETREF(self->log_debug, log_debug);
+	Py_XSETREF(self->on_gap, on_gap);
+	// The connections of a handler share one dict, since the module
+	// reconnects in the middle of its sequence.
+	if (sequence != NULL) {
+		Py_INCREF(sequence);
+		Py_XSETREF(self->sequence, sequence);
+	}
+	else {
+		Py_XSETREF(self->sequence, PyDict_New());
+	}
+	Py_XSETREF(self->disconnect_name, PyString_InternFromString("disconnect"));
+	Py_XSETREF(self->default_name, PyString_InternFromString("defaultOperation"));
+	Py_XSETREF(self->status_name, PyString_InternFromString("status"));
+	Py_XSETREF(self->hints_name, PyString_InternFromString("hints"));
+	if (self->disconnect_name == NULL || self->default_name == NULL || self->status_name == NULL ||
+	    self->hints_name == NULL ||
+	    self->sequence == NULL) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Hands the pending exception to the on_error hook and clears it */
+static void vfsx_report_error(Dispatcher *self)
+{
+	PyObject *type, *value, *tb, *ret;
+
+	PyErr_Fetch(&type, &value, &tb);
+	PyErr_NormalizeException(&type, &value, &tb);
+	ret = PyObject_CallFunctionObjArgs(self->on_error, type,
+					   value ? value : Py_None, tb ? tb : Py_None, NULL);
+	Py_XDECREF(ret);
+	Py_XDECREF(type);
+	Py_XDECREF(value);
+	Py_XDECREF(tb);
+	PyErr_Clear();
+}
+
+static PyObject *vfsx_interned(const char *str, Py_ssize_t len)
+{
+	PyObject *s = PyString_FromStringAndSize(str, len);
+
+	if (s != NULL) {
+		PyString_InternInPlace(&s);
+	}
+	return s;
+}
+
+/* The fields of "operation:origpath:arg1,arg2:seq,pid,key:" */
+struct vfsx_fields {
+	const char *op, *origpath, *args, *info;
+	Py_ssize_t op_len, origpath_len, args_len, info_len;
+	int has_args, has_info;
+};
+
+/*
+ * Splits a message the way VFSHandler does: the fields are split on ':'
+ * over the whole message, padding included.  When a fourth field follows,
+ * it is the event info stamped by the module and an empty argument field
+ * means no arguments.  Otherwise the arguments are only taken when a field
+ * follows them.
+ */
+static int vfsx_split(const char *msg, struct vfsx_fields *f)
+{
+	const char *end = msg + VFSX_MSG_OUT_SIZE;
+	const char *field[4];
+	Py_ssize_t flen[4];
+	const char *p = msg, *q;
+	int colons;
+
+	for (colons = 0; colons < 4; colons++) {
+		q = memchr(p, ':', end - p);
+		field[colons] = p;
+		flen[colons] = (q != NULL ? q : end) - p;
+		if (q == NULL) {
+			break;
+		}
+		p = q + 1;
+	}
+	if (colons < 1) {
+		PyErr_SetString(PyExc_ValueError, "need more than 1 value to unpack");
+		return -1;
+	}
+	memset(f, 0, sizeof(*f));
+	f->op = field[0];
+	f->op_len = flen[0];
+	f->origpath = field[1];
+	f->origpath_len = flen[1];
+	if (colons >= 3) {
+		f->args = field[2];
+		f->args_len = flen[2];
+		f->has_args = (colons == 3 || flen[2] > 0);
+	}
+	if (colons == 4) {
+		f->info = field[3];
+		f->info_len = flen[3];
+		f->has_info = 1;
+	}
+	return 0;
+}
+
+/*
+ * Parses "seq,pid,key" like parseEventInfo() in vfsx.py.  Returns 0 when
+ * the info is malformed.
+ */
+static int vfsx_parse_info(const struct vfsx_fields *f, unsigned long long *seq, long *pid,
+			   const char **key, Py_ssize_t *key_len)
+{
+	const char *end = f->info + f->info_len;
+	const char *comma1, *comma2;
+	char num[32];
+	char *stop;
+	Py_ssize_t len;
+
+	comma1 = memchr(f->info, ',', f->info_len);
+	if (comma1 == NULL) {
+		return 0;
+	}
+	comma2 = memchr(comma1 + 1, ',', end - comma1 - 1);
+	if (comma2 == NULL || memchr(comma2 + 1, ',', end - comma2 - 1) != NULL) {
+		return 0;
+	}
+
+	len = comma1 - f->info;
+	if (len == 0 || len >= (Py_ssize_t)sizeof(num)) {
+		return 0;
+	}
+	memcpy(num, f->info, len);
+	num[len] = '\0';
+	errno = 0;
+	*seq = strtoull(num, &stop, 10);
+	if (*stop != '\0' || errno != 0 || num[0] == '-') {
+		return 0;
+	}
+
+	len = comma2 - comma1 - 1;
+	if (len == 0 || len >= (Py_ssize_t)sizeof(num)) {
+		return 0;
+	}
+	memcpy(num, comma1 + 1, len);
+	num[len] = '\0';
+	*pid = strtol(num, &stop, 10);
+	if (*stop != '\0' || errno != 0) {
+		return 0;
+	}
+
+	*key = comma2 + 1;
+	*key_len = end - *key;
+	return 1;
+}
+
+/*
+ * Follows the sequence numbers of each smbd process like EventSequence in
+ * vfsx.py and hands the numbers that never arrived to the on_gap hook.
+ */
+static void vfsx_check_sequence(Dispatcher *self, const struct vfsx_fields *f,
+				unsigned long long seq, long pid)
+{
+	PyObject *pid_obj, *seq_obj, *last_obj, *ret;
+	unsigned long long last = 0;
+	int known = 0;
+
+	pid_obj = PyInt_FromLong(pid);
+	seq_obj = PyLong_FromUnsignedLongLong(seq);
+	if (pid_obj == NULL || seq_obj == NULL) {
+		goto done;
+	}
+	last_obj = PyDict_GetItem(self->sequence, pid_obj);
+	if (last_obj != NULL) {
+		last = PyLong_AsUnsignedLongLong(last_obj);
+		known = 1;
+	}
+	if (PyDict_SetItem(self->sequence, pid_obj, seq_obj) < 0) {
+		goto done;
+	}
+	if (known && seq > last + 1) {
+		ret = PyObject_CallFunction(self->on_gap, "s#OKK", f->origpath, f->origpath_len,
+					    pid_obj, last + 1, seq - 1);
+		Py_XDECREF(ret);
+	}
+
+done:
+	if (PyErr_Occurred()) {
+		vfsx_report_error(self);
+	}
+	Py_XDECREF(pid_obj);
+	Py_XDECREF(seq_obj);
+}
+
+/* Checks the sequence of a message and returns the key its events are ordered by */
+static PyObject *vfsx_event_key(Dispatcher *self, const char *msg)
+{
+	struct vfsx_fields f;
+	unsigned long long seq;
+	long pid;
+	const char *key = "", *comma;
+	Py_ssize_t key_len = 0;
+
+	if (vfsx_split(msg, &f) < 0) {
+		PyErr_Clear();
+		return PyString_FromStringAndSize("", 0);
+	}
+	if (f.has_info && vfsx_parse_info(&f, &seq, &pid, &key, &key_len)) {
+		if (self->on_gap != Py_None) {
+			vfsx_check_sequence(self, &f, seq, pid);
+		}
+	}
+	if (key_len == 0) {
+		if (f.has_args) {
+			comma = memchr(f.args, ',', f.args_len);
+			key = f.args;
+			key_len = (comma != NULL ? comma : f.args + f.args_len) - f.args;
+		}
+		else {
+			key = f.origpath;
+			key_len = f.origpath_len;
+		}
+	}
+	return PyString_FromStringAndSize(key, key_len);
+}
+
+/* Executes a split message against its session */
+static PyObject *vfsx_call(Dispatcher *self, const struct vfsx_fields *f)
+{
+	PyObject *op = NULL, *origpath = NULL, *session = NULL, *method = NULL;
+	PyObject *args = NULL, *result = NULL, *ret;
+	const char *p, *q, *end;
+	int nargs = 0, i;
+
+	op = vfsx_interned(f->op, f->op_len);
+	origpath = vfsx_interned(f->origpath, f->origpath_len);
+	if (op == NULL || origpath == NULL) {
+		goto done;
+	}
+
+	if (f->has_args) {
+		const char *start[VFSX_MAX_ARGS];
+		Py_ssize_t alen[VFSX_MAX_ARGS];
+
+		p = f->args;
+		end = f->args + f->args_len;
+		for (;;) {
+			q = memchr(p, ',', end - p);
+			if (nargs == VFSX_MAX_ARGS) {
+				PyErr_SetString(PyExc_ValueError, "too many arguments");
+				goto done;
+			}
+			start[nargs] = p;
+			alen[nargs] = (q != NULL ? q : end) - p;
+			nargs++;
+			if (q == NULL) {
+				break;
+			}
+			p = q + 1;
+		}
+		args = PyTuple_New(nargs);
+		if (args == NULL) {
+			goto done;
+		}
+		for (i = 0; i < nargs; i++) {
+			PyObject *arg = PyString_FromStringAndSize(start[i], alen[i]);
+			if (arg == NULL) {
+				goto done;
+			}
+			PyTuple_SET_ITEM(args, i, arg);
+		}
+	}
+	else {
+		args = PyTuple_New(0);
+		if (args == NULL) {
+			goto done;
+		}
+	}
+
+	session = PyDict_GetItem(self->sessions, origpath);
+	if (session != NULL) {
+		Py_INCREF(session);
+	}
+	else {
+		session = PyObject_CallFunctionObjArgs(self->get_session, origpath, NULL);
+		if (session == NULL) {
+			goto done;
+		}
+	}
+	if (PyObject_RichCompareBool(op, self->disconnect_name, Py_EQ) == 1) {
+		ret = PyObject_CallFunctionObjArgs(self->remove_session, session, NULL);
+		if (ret == NULL) {
+			goto done;
+		}
+		Py_DECREF(ret);
+	}
+
+	/* private attributes are never operations */
+	if (f->op_len > 0 && f->op[0] != '_') {
+		method = PyObject_GetAttr(session, op);
+	}
+	if (method == NULL) {
+		if (PyErr_Occurred() && !PyErr_ExceptionMatches(PyExc_AttributeError)) {
+			goto done;
+		}
+		PyErr_Clear();
+		method = PyObject_GetAttr(session, self->default_name);
+		if (method == NULL) {
+			goto done;
+		}
+	}
+	result = PyObject_Call(method, args, NULL);
+
+done:
+	Py_XDECREF(op);
+	Py_XDECREF(origpath);
+	Py_XDECREF(session);
+	Py_XDECREF(method);
+	Py_XDECREF(args);
+	return result;
+}
+
+static int vfsx_status(Dispatcher *self, PyObject *result)
+{
+	PyObject *status;
+	long value;
+
+	if (result == NULL) {
+		return VFSX_FAIL_ERROR;
+	}
+	status = PyObject_GetAttr(result, self->status_name);
+	if (status == NULL) {
+		PyErr_Clear();
+		return VFSX_SUCCESS_TRANSPARENT;
+	}
+	value = PyInt_AsLong(status);
+	Py_DECREF(status);
+	if (value == -1 && PyErr_Occurred()) {
+		vfsx_report_error(self);
+		return VFSX_FAIL_ERROR;
+	}
+	return (int)value;
+}
+
+/*
+ * Formats the reply like VFSHandler.formatReply(): the padded status, or
+ * "H", the payload length in hex and "status:hint,hint" when the result
+ * carries hints.  Returns the reply length.
+ */
+static Py_ssize_t vfsx_format_reply(Dispatcher *self, PyObject *result, char *out)
+{
+	char payload[VFSX_HINTS_MAX + 1], head[VFSX_MSG_IN_SIZE + 1];
+	PyObject *hints = NULL, *iter, *item, *text;
+	Py_ssize_t len, n;
+	int status = vfsx_status(self, result);
+	int sep = 0;
+
+	if (result != NULL) {
+		hints = PyObject_GetAttr(result, self->hints_name);
+		if (hints == NULL) {
+			PyErr_Clear();
+		}
+	}
+	if (hints == NULL || PyObject_IsTrue(hints) != 1) {
+		PyErr_Clear();
+		Py_XDECREF(hints);
+		memset(payload, 0, sizeof(payload));
+		snprintf(payload, sizeof(payload), "%d", status);
+		memcpy(out, payload, VFSX_MSG_IN_SIZE);
+		return VFSX_MSG_IN_SIZE;
+	}
+
+	len = snprintf(payload, sizeof(payload), "%d:", status);
+	iter = PyObject_GetIter(hints);
+	while (iter != NULL && (item = PyIter_Next(iter)) != NULL) {
+		text = PyObject_Str(item);
+		Py_DECREF(item);
+		if (text == NULL) {
+			break;
+		}
+		n = PyString_GET_SIZE(text);
+		if (len + sep + n > VFSX_HINTS_MAX) {
+			Py_DECREF(text);
+			break;
+		}
+		if (sep) {
+			payload[len++] = ',';
+		}
+		memcpy(payload + len, PyString_AS_STRING(text), n);
+		len += n;
+		sep = 1;
+		Py_DECREF(text);
+	}
+	Py_XDECREF(iter);
+	Py_DECREF(hints);
+	if (PyErr_Occurred()) {
+		vfsx_report_error(self);
+	}
+
+	snprintf(head, sizeof(head), "H%02x", (unsigned int)len);
+	memcpy(out, head, VFSX_MSG_IN_SIZE);
+	memcpy(out + VFSX_MSG_IN_SIZE, payload, len);
+	return VFSX_MSG_IN_SIZE + len;
+}
+
+PyDoc_STRVAR(Dispatcher_dispatch_doc,
+"dispatch(data, debug=False, sequence=True) -> (replies, consumed)\n\n"
+"Executes every complete message in data and returns the concatenated\n"
+"replies and the number of bytes used.  With sequence, the sequence\n"
+"numbers of the messages are checked for gaps.");
+
+static PyObject *Dispatcher_dispatch(Dispatcher *self, PyObject *args)
+{
+	const char *data;
+	Py_ssize_t len, size, count, i, used = 0, reply_len;
+	PyObject *replies, *result, *ret;
+	char reply[VFSX_MSG_IN_SIZE + VFSX_HINTS_MAX];
+	int debug = 0, sequence = 1;
+	struct vfsx_fields f;
+	unsigned long long seq;
+	long pid;
+	const char *key;
+	Py_ssize_t key_len;
+
+	if (!PyArg_ParseTuple(args, "s#|ii", &data, &len, &debug, &sequence)) {
+		return NULL;
+	}
+	size = self->id_size + VFSX_MSG_OUT_SIZE;
+	count = len / size;
+	replies = PyString_FromStringAndSize(NULL, count * (self->id_size + VFSX_MSG_IN_SIZE));
+	if (replies == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		const char *record = data + i * size;
+		const char *msg = record + self->id_size;
+
+		if (debug) {
+			ret = PyObject_CallFunction(self->log_debug, "s#", msg, (Py_ssize_t)VFSX_MSG_OUT_SIZE);
+			if (ret == NULL) {
+				vfsx_report_error(self);
+			}
+			Py_XDECREF(ret);
+		}
+		result = NULL;
+		if (vfsx_split(msg, &f) == 0) {
+			if (sequence && self->on_gap != Py_None && f.has_info &&
+			    vfsx_parse_info(&f, &seq, &pid, &key, &key_len)) {
+				vfsx_check_sequence(self, &f, seq, pid);
+			}
+			result = vfsx_call(self, &f);
+		}
+		if (result == NULL) {
+			vfsx_report_error(self);
+		}
+		reply_len = vfsx_format_reply(self, result, reply);
+		Py_XDECREF(result);
+
+		/* replies with hints outgrow the plain estimate */
+		if (used + self->id_size + reply_len > PyString_GET_SIZE(replies)) {
+			if (_PyString_Resize(&replies, 2 * (used + self->id_size + reply_len)) < 0) {
+				return NULL;
+			}
+		}
+		memcpy(PyString_AS_STRING(replies) + used, record, self->id_size);
+		used += self->id_size;
+		memcpy(PyString_AS_STRING(replies) + used, reply, reply_len);
+		used += reply_len;
+	}
+	if (used != PyString_GET_SIZE(replies) && _PyString_Resize(&replies, used) < 0) {
+		return NULL;
+	}
+	return Py_BuildValue("(Nn)", replies, count * size);
+}
+
+PyDoc_STRVAR(Dispatcher_frame_doc,
+"frame(data) -> (records, consumed)\n\n"
+"Splits the complete messages in data into (record, key) pairs for the\n"
+"worker pool, checking their sequence numbers in arrival order.");
+
+static PyObject *Dispatcher_frame(Dispatcher *self, PyObject *args)
+{
+	const char *data;
+	Py_ssize_t len, size, count, i;
+	PyObject *records, *record, *key;
+
+	if (!PyArg_ParseTuple(args, "s#", &data, &len)) {
+		return NULL;
+	}
+	size = self->id_size + VFSX_MSG_OUT_SIZE;
+	count = len / size;
+	records = PyList_New(count);
+	if (records == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		key = vfsx_event_key(self, data + i * size + self->id_size);
+		if (key == NULL) {
+			Py_DECREF(records);
+			return NULL;
+		}
+		record = Py_BuildValue("(s#N)", data + i * size, size, key);
+		if (record == NULL) {
+			Py_DECREF(records);
+			return NULL;
+		}
+		PyList_SET_ITEM(records, i, record);
+	}
+	return Py_BuildValue("(Nn)", records, count * size);
+}
+
+static PyMethodDef Dispatcher_methods[] = {
+	{ "dispatch", (PyCFunction)Dispatcher_dispatch, METH_VARARGS, Dispatcher_dispatch_doc },
+	{ "frame", (PyCFunction)Dispatcher_frame, METH_VARARGS, Dispatcher_frame_doc },
+	{ NULL, NULL, 0, NULL }
+};
+
+PyDoc_STRVAR(Dispatcher_doc,
+"Dispatcher(id_size, sessions, get_session, remove_session, on_error, log_debug,\n"
+"           on_gap=None, sequence=None)\n\n"
+"Executes module messages against the sessions of VFSModuleSession.\n"
+"sequence is the dict of the last sequence number seen per pid, one of\n"
+"its own if not given.");
+
+static PyTypeObject DispatcherType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"_vfsx.Dispatcher",			/* tp_name */
+	sizeof(Dispatcher),			/* tp_basicsize */
+	0,					/* tp_itemsize */
+	(destructor)Dispatcher_dealloc,		/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	0,					/* tp_repr */
+	0,					/* tp_as_number */
+	0,					/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	0,					/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,			/* tp_flags */
+	Dispatcher_doc,				/* tp_doc */
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	0,					/* tp_iter */
+	0,					/* tp_iternext */
+	Dispatcher_methods,			/* tp_methods */
+	0,					/* tp_members */
+	0,					/* tp_getset */
+	0,					/* tp_base */
+	0,					/* tp_dict */
+	0,					/* tp_descr_get */
+	0,					/* tp_descr_set */
+	0,					/* tp_dictoffset */
+	(initproc)Dispatcher_init,		/* tp_init */
+	0,					/* tp_alloc */
+	PyType_GenericNew,			/* tp_new */
+};
+
+static PyMethodDef vfsx_methods[] = {
+	{ NULL, NULL, 0, NULL }
+};
+
+PyMODINIT_FUNC init_vfsx(void)
+{
+	PyObject *m;
+
+	if (PyType_Ready(&DispatcherType) < 0) {
+		return;
+	}
+	m = Py_InitModule3("_vfsx", vfsx_methods, "Accelerated message dispatch for the VFSX handler.");
+	if (m == NULL) {
+		return;
+	}
+	Py_INCREF(&DispatcherType);
+	PyModule_AddObject(m, "Dispatcher", (PyObject *)&DispatcherType);
+}
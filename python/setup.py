@@ -0,0 +1,11 @@
+#
+# Builds the optional _vfsx extension, which vfsx.py uses for message
+# dispatch when it can be imported:  python setup.py build_ext --inplace
+#
+from distutils.core import setup, Extension
+
+setup(name="vfsx",
+      version="0.3",
+      description="VFSX - Samba VFS External Bridge handler",
+      py_modules=["vfsx", "vfsx_broker", "vfsx_replay", "vfsx_journal"],
+      ext_modules=[Extension("_vfsx", ["_vfsx.c"])])
@@ -9,8 +9,22 @@ pydevd.settrace('10.0.1.214', port=31313, stdoutToServer=True, stderrToServer=Tr
 import sys
 import os
 import os.path
+import time
+import errno
+import select
+import signal
+import struct
+import socket
 import SocketServer
 import logging
+import threading
+import Queue
+
+# The optional compiled dispatcher (see setup.py)
+try:
+    import _vfsx
+except ImportError:
+    _vfsx = None
 
 # General error.  VFS operation should not proceed.
 FAIL_ERROR = -1
@@ -28,16 +42,69 @@ SUCCESS_TRANSPARENT = 0
 # The Unix domain socket file
 SOCKET_FILE = "/tmp/vfsx-socket"
 
+# The socket served behind vfsx_broker.py (see VFSBatchHandler)
+HANDLER_SOCKET_FILE = "/tmp/vfsx-handler-socket"
+
+# Size of a module message and of a reply.  Replies are padded to the full
+# size so the module can read pipelined replies (see "vfsx:slo usec").
+MSG_OUT_SIZE = 512
+MSG_IN_SIZE = 3
+
+# Longest reply payload with I/O hints (see formatReply())
+MAX_HINTS_SIZE = 255
+
+# I/O hints an open or create result can carry.  The module applies them to
+# the opened file with posix_fadvise() and readahead().
+HINT_NORMAL = "normal"
+HINT_SEQUENTIAL = "sequential"
+HINT_RANDOM = "random"
+# Read once: the file's pages are also dropped from the cache at close.
+HINT_NOREUSE = "noreuse"
+
+# Broker link framing: a request ID in front of every message and reply
+REQUEST_ID = struct.Struct("!I")
+
+# Bytes read from a connection at once
+RECV_SIZE = 64 * (REQUEST_ID.size + MSG_OUT_SIZE)
+
+# Operations a worker pool runs only after all earlier events are answered
+# and before any later one starts (see VFSBatchHandler)
+BARRIER_OPERATIONS = frozenset(["connect", "disconnect", "stats", "usage"])
+
+# First descriptor of a listening socket passed in with LISTEN_FDS
+LISTEN_FDS_START = 3
+
+# Seconds a restarting handler waits for its successor, and then for its
+# own connections to drain (see VFSRestart)
+RESTART_TIMEOUT = 30.0
+
 # Logger for this module
 logging.basicConfig()
 log = logging.getLogger("vfsx")
 log.setLevel(logging.DEBUG)
 
 
+# "hints" is an optional list of I/O hints, see HINT_SEQUENTIAL and friends.
+# The module only applies them to open and create, and only while it waits
+# for replies.
 class VFSOperationResult(object):
 
-    def __init__(self, status):
+    def __init__(self, status, hints=None):
         self.status = status
+        self.hints = hints
+
+
+# Range hints.  A length of 0 reaches to the end of the file.
+def hintWillNeed(offset=0, length=0):
+    return "willneed=%d+%d" % (offset, length)
+
+
+def hintDontNeed(offset=0, length=0):
+    return "dontneed=%d+%d" % (offset, length)
+
+
+def hintReadahead(offset, length):
+    return "readahead=%d+%d" % (offset, length)
 
 
 class VFSModuleSession(object):
@@ -48,6 +115,9 @@ class VFSModuleSession(object):
     # All connected sessions
     __sessions = {}
 
+    # Guards session creation when a worker pool runs operations in parallel
+    __lock = threading.Lock()
+
     def setSessionClass(sessionClass):
         VFSModuleSession.__sessionClass = sessionClass
 
@@ -61,20 +131,29 @@ class VFSModuleSession(object):
     def getSession(origpath):
         sessions = VFSModuleSession.__sessions
         key = origpath
-        if sessions.has_key(key):
-            session = sessions[key]
-            log.debug("Existing session: %s" % session)
-        else:
-            session = VFSModuleSession.__sessionClass(key)
-            sessions[key] = session
-            log.debug("New session: %s" % session)
+        VFSModuleSession.__lock.acquire()
+        try:
+            if sessions.has_key(key):
+                session = sessions[key]
+                log.debug("Existing session: %s" % session)
+            else:
+                session = VFSModuleSession.__sessionClass(key)
+                sessions[key] = session
+                log.debug("New session: %s" % session)
+        finally:
+            VFSModuleSession.__lock.release()
         return session
 
     getSession = staticmethod(getSession)
 
+    def getSessions():
+        return VFSModuleSession.__sessions
+
+    getSessions = staticmethod(getSessions)
+
     def removeSession(session):
         key = session.origpath
-        del VFSModuleSession.__sessions[key]
+        VFSModuleSession.__sessions.pop(key, None)
         log.debug("Removed session: %s" % session)
 
     removeSession = staticmethod(removeSession)
@@ -101,6 +180,25 @@ class VFSModuleSession(object):
     def disconnect(self):
         return VFSOperationResult(SUCCESS_TRANSPARENT)
 
+    # Sent before disconnect when the module runs with an SLO: the current
+    # level and the degradation counters of the smbd process.
+    def stats(self, level, degraded, recovered, sampledOut, bypassed,
+              dropped, timeouts):
+        return VFSOperationResult(SUCCESS_TRANSPARENT)
+
+    # Sent with "vfsx:usage interval usec": what user uid did on the share
+    # in one smbd process over the last usec microseconds.
+    def usage(self, uid, usec, bytesRead, bytesWritten, reads, writes,
+              opens, creates):
+        return VFSOperationResult(SUCCESS_TRANSPARENT)
+
+    # Called when the events numbered first to last of the smbd process pid
+    # never arrived: the module dropped them under "vfsx:slo usec", or they
+    # were lost while the handler was unreachable.
+    def eventsLost(self, pid, first, last):
+        log.warning("%s: events %d to %d of smbd %d lost"
+                    % (self.origpath, first, last, pid))
+
     # VFS directory operations
 
     def opendir(self, path):
@@ -146,67 +244,556 @@ class VFSModuleSession(object):
         return VFSOperationResult(SUCCESS_TRANSPARENT)
 
 
-# Expects a string of the form "operation:origpath:arg1,arg2,arg3" where
-# "operation" is the VFS operation.  It should exactly match the method on
-# VFSModuleSession.  A new VFSModuleSession is created for each "connect"
-# operation.
+# Parses the "seq,pid,key" info the module stamps on each event: the
+# sequence number of the event in its smbd process, the process ID and the
+# key of the file ("dev-inode" in hex, empty when the event has no file).
+# Returns None when the info is malformed.
+def parseEventInfo(text):
+    fields = text.split(",")
+    if len(fields) != 3:
+        return None
+    try:
+        return (long(fields[0]), int(fields[1]), fields[2])
+    except ValueError:
+        return None
+
+
+# The key events are ordered by: the file key, or else the path argument, or
+# else the share.
+def eventKey(origpath, args, info):
+    if info is not None and info[2]:
+        return info[2]
+    if args:
+        return args[0]
+    return origpath
+
+
+# Follows the sequence numbers of each smbd process and reports the numbers
+# that never arrived through _eventsLost().  A number at or below the last
+# one seen means the process ID was reused and starts over.  The handler
+# keeps one for all its connections (see VFSHandler.sequence): the module
+# opens a new connection after a disconnect or a failure, which is when
+# events get lost.
+class EventSequence(object):
+
+    def __init__(self):
+        self.last = {}
+        self.lock = threading.Lock()
+
+    def check(self, origpath, seq, pid):
+        self.lock.acquire()
+        try:
+            last = self.last.get(pid)
+            self.last[pid] = seq
+        finally:
+            self.lock.release()
+        if last is not None and seq > last + 1:
+            _eventsLost(origpath, pid, last + 1, seq - 1)
+
+
+# A fixed set of worker threads.  Jobs submitted with the same key always
+# run on the same thread, in the order they were submitted.
+class VFSWorkerPool(object):
+
+    def __init__(self, size):
+        self.queues = []
+        for i in range(size):
+            queue = Queue.Queue()
+            thread = threading.Thread(target=self.__work, args=(queue,),
+                                      name="vfsx-worker-%d" % i)
+            thread.daemon = True
+            thread.start()
+            self.queues.append(queue)
+
+    def submit(self, key, job, *args):
+        self.queues[hash(key) % len(self.queues)].put((job, args))
+
+    def __work(self, queue):
+        while True:
+            (job, args) = queue.get()
+            try:
+                job(*args)
+            except Exception, e:
+                log.exception(e)
+
+
+# Expects a string of the form "operation:origpath:arg1,arg2,arg3:seq,pid,key"
+# where "operation" is the VFS operation.  It should exactly match the method
+# on VFSModuleSession.  A new VFSModuleSession is created for each "connect"
+# operation.  Messages of older modules lack the "seq,pid,key" field.
 class VFSHandler(SocketServer.BaseRequestHandler):
 
+    # Bytes in front of each message that are echoed in front of its reply
+    requestIdSize = 0
+
+    # Sequence numbers seen on all connections
+    sequence = EventSequence()
+
+    # Connections being served.  Once draining, no new messages are read.
+    connections = set()
+    connectionsLock = threading.Lock()
+    draining = False
+
+    # Limits how many connections run operations at once when module
+    # connections are served on threads (see runServer())
+    slots = None
+
+    def setup(self):
+        self.dispatcher = None
+        if _vfsx is not None:
+            self.dispatcher = _vfsx.Dispatcher(
+                self.requestIdSize, VFSModuleSession.getSessions(),
+                VFSModuleSession.getSession, VFSModuleSession.removeSession,
+                _logError, log.debug, _eventsLost, self.sequence.last)
+        VFSHandler.connectionsLock.acquire()
+        try:
+            VFSHandler.connections.add(self.request)
+            if VFSHandler.draining:
+                _shutdownRead(self.request)
+        finally:
+            VFSHandler.connectionsLock.release()
+
+    def finish(self):
+        VFSHandler.connectionsLock.acquire()
+        try:
+            VFSHandler.connections.discard(self.request)
+        finally:
+            VFSHandler.connectionsLock.release()
+
+    # Stops reading from every connection.  The messages already received
+    # are still answered, then the connections close.  A client's next write
+    # fails, so it knows which messages to send again elsewhere.
+    def drainConnections():
+        VFSHandler.connectionsLock.acquire()
+        try:
+            VFSHandler.draining = True
+            for sock in VFSHandler.connections:
+                _shutdownRead(sock)
+        finally:
+            VFSHandler.connectionsLock.release()
+    drainConnections = staticmethod(drainConnections)
+
+    # Waits up to timeout seconds for the connections to close.
+    def waitForConnections(timeout):
+        deadline = time.time() + timeout
+        while VFSHandler.connections and time.time() < deadline:
+            time.sleep(0.05)
+        return not VFSHandler.connections
+    waitForConnections = staticmethod(waitForConnections)
+
     def handle(self):
         log.debug("-- Open Connection --")
+        pending = ""
         while True:
-            msg = self.request.recv(512)
-            if not msg: break
-            log.debug(msg)
-            # Handle message-parsing and operation execution error here.
-            # Socket communication errors should be propagated.
-            try:
-                (operation, origpath, args) = self.__parseMessage(msg)
-                result = self.__callOperation(operation, origpath, args)
-            except Exception, e:
-                result = VFSOperationResult(FAIL_ERROR)
-                log.exception(e)
-            # sys.stderr.write("%s\n" % msg)
-            self.request.send("%d" % 0)
+            data = _recv(self.request, RECV_SIZE)
+            if not data: break
+            pending += data
+            if self.slots is not None:
+                self.slots.acquire()
+                try:
+                    (replies, used) = self.dispatch(pending)
+                finally:
+                    self.slots.release()
+            else:
+                (replies, used) = self.dispatch(pending)
+            pending = pending[used:]
+            if replies:
+                self.request.sendall(replies)
 
         # The client probably closed the connection.
         self.request.close()
         log.debug("Close Connection")
 
+    # Executes every complete message in data.  Returns the replies and the
+    # number of bytes used.
+    def dispatch(self, data):
+        if self.dispatcher is not None:
+            return self.dispatcher.dispatch(data, log.isEnabledFor(logging.DEBUG))
+        size = self.requestIdSize + MSG_OUT_SIZE
+        count = len(data) // size
+        replies = []
+        for i in range(count):
+            record = data[i * size:(i + 1) * size]
+            result = self.processMessage(record[self.requestIdSize:], self.sequence)
+            replies.append(record[:self.requestIdSize] + self.formatReply(result))
+        return ("".join(replies), count * size)
+
+    # Splits every complete message in data into (record, key) pairs for a
+    # worker pool, checking the sequence numbers in arrival order.  Returns
+    # the pairs and the number of bytes used.
+    def frame(self, data):
+        if self.dispatcher is not None:
+            return self.dispatcher.frame(data)
+        size = self.requestIdSize + MSG_OUT_SIZE
+        count = len(data) // size
+        records = []
+        for i in range(count):
+            record = data[i * size:(i + 1) * size]
+            try:
+                (operation, origpath, args, info) = self.__parseMessage(record[self.requestIdSize:])
+            except Exception:
+                # processMessage() reports it.
+                records.append((record, ""))
+                continue
+            if info is not None:
+                self.sequence.check(origpath, info[0], info[1])
+            records.append((record, eventKey(origpath, args, info)))
+        return (records, count * size)
+
+    # Executes a single message and returns its reply.  Sequence numbers
+    # are checked when sequence is given.
+    def execute(self, record, sequence=None):
+        if self.dispatcher is not None:
+            (reply, used) = self.dispatcher.dispatch(
+                record, log.isEnabledFor(logging.DEBUG), sequence is not None)
+            return reply
+        result = self.processMessage(record[self.requestIdSize:], sequence)
+        return record[:self.requestIdSize] + self.formatReply(result)
+
+    def processMessage(self, msg, sequence=None):
+        log.debug(msg)
+        # Handle message-parsing and operation execution error here.
+        # Socket communication errors should be propagated.
+        try:
+            (operation, origpath, args, info) = self.__parseMessage(msg)
+            log.debug("  operation = '%s' origpath = '%s' args = %s"
+                      % (operation, origpath, args))
+            if sequence is not None and info is not None:
+                sequence.check(origpath, info[0], info[1])
+            result = self.__callOperation(operation, origpath, args)
+        except Exception, e:
+            result = VFSOperationResult(FAIL_ERROR)
+            log.exception(e)
+        return result
+
+    # A result with hints is sent as "H", the payload length in two hex
+    # digits and "status:hint,hint".  Hints that don't fit are left out.
+    def formatReply(self, result):
+        status = getattr(result, "status", SUCCESS_TRANSPARENT)
+        hints = getattr(result, "hints", None)
+        if hints:
+            payload = "%d:" % status
+            sep = ""
+            for hint in hints:
+                hint = str(hint)
+                if len(payload) + len(sep) + len(hint) > MAX_HINTS_SIZE:
+                    break
+                payload += sep + hint
+                sep = ","
+            return "H%02x%s" % (len(payload), payload)
+        return ("%d" % status)[:MSG_IN_SIZE].ljust(MSG_IN_SIZE, "\0")
+
     def __parseMessage(self, msg):
         parts = msg.split(":")
         (operation, origpath) = parts[0:2]
-        log.debug("  operation = '%s' origpath = '%s'" %
-                  (operation, origpath))
         args = []
-        if len(parts) > 3:
+        info = None
+        if len(parts) > 4:
+            if parts[2]:
+                args = parts[2].split(",")
+            info = parseEventInfo(parts[3])
+        elif len(parts) > 3:
             args = parts[2].split(",")
-            log.debug("  args = '%s'" % parts[2])
-        return (operation, origpath, args)
+        return (operation, origpath, args, info)
 
     def __callOperation(self, operation, origpath, args):
         session = VFSModuleSession.getSession(origpath)
         if operation == "disconnect":
             VFSModuleSession.removeSession(session)
         sessionClass = VFSModuleSession.getSessionClass()
-        try:
-            method = eval("sessionClass.%s" % operation)
-        except AttributeError:
+        method = None
+        # Private attributes are never operations.
+        if operation and not operation.startswith("_"):
+            method = getattr(sessionClass, operation, None)
+        if method is None:
             method = sessionClass.defaultOperation
         return method(session, *args)
 
 
-def runServer(vfsSessionClass):
+# Serves the links of vfsx_broker.py.  Each request is a 4 byte request ID
+# in network order followed by a module message, each reply the same ID
+# followed by the padded reply.  Requests are read in whole batches and
+# their replies are written back together.
+#
+# With a worker pool (see runServer()), the requests are spread over the
+# workers by event key, so the events of one file stay in order while other
+# files proceed in parallel.  Replies then go back as each one completes; the
+# broker puts them back into each smbd's order.  The operations in
+# BARRIER_OPERATIONS wait for all earlier requests of the link and run before
+# later ones start, so a session sees no file events outside connect and
+# disconnect.
+class VFSBatchHandler(VFSHandler):
+
+    requestIdSize = REQUEST_ID.size
+
+    # Shared by all links
+    workerPool = None
+
+    def handle(self):
+        if self.workerPool is None:
+            VFSHandler.handle(self)
+            return
+        log.debug("-- Open Connection --")
+        self.sendLock = threading.Lock()
+        self.idle = threading.Condition(threading.Lock())
+        self.outstanding = 0
+        pending = ""
+        while True:
+            data = _recv(self.request, RECV_SIZE)
+            if not data: break
+            pending += data
+            (records, used) = self.frame(pending)
+            pending = pending[used:]
+            for (record, key) in records:
+                # Connect, disconnect and the reports run alone, in order
+                # with everything before and after them.
+                barrier = self.isBarrier(record)
+                if barrier:
+                    self.waitIdle(0)
+                self.idle.acquire()
+                self.outstanding += 1
+                self.idle.release()
+                if barrier:
+                    self.reply(record)
+                else:
+                    self.workerPool.submit(key, self.reply, record)
+
+        # Answer what was received before closing, which matters when the
+        # connection is drained.
+        self.waitIdle(0)
+
+        # The client probably closed the connection.
+        self.request.close()
+        log.debug("Close Connection")
+
+    def isBarrier(self, record):
+        operation = record[self.requestIdSize:].split(":", 1)[0]
+        return operation in BARRIER_OPERATIONS
+
+    # Waits until no more than count records are outstanding
+    def waitIdle(self, count):
+        self.idle.acquire()
+        try:
+            while self.outstanding > count:
+                self.idle.wait()
+        finally:
+            self.idle.release()
+
+    def reply(self, record):
+        try:
+            reply = self.execute(record)
+            self.sendLock.acquire()
+            try:
+                try:
+                    self.request.sendall(reply)
+                except socket.error, e:
+                    log.debug("Reply lost: %s" % e)
+            finally:
+                self.sendLock.release()
+        finally:
+            self.idle.acquire()
+            self.outstanding -= 1
+            self.idle.notify()
+            self.idle.release()
+
+
+# Restarts the handler without closing its socket.  On SIGHUP the handler
+# starts a new copy of itself that inherits the listening socket the way
+# systemd socket activation passes one (LISTEN_FDS, LISTEN_PID).  Once the
+# copy is serving, this process stops accepting, drains its connections and
+# exits.  Clients find the copy when they reconnect; the module sends the
+# events the old process did not read again.
+class VFSRestart(object):
+
+    def __init__(self, server):
+        self.server = server
+        self.restarting = False
+        signal.signal(signal.SIGHUP, self.__onSignal)
+
+    def __onSignal(self, signum, frame):
+        if self.restarting or VFSHandler.draining:
+            return
+        self.restarting = True
+        thread = threading.Thread(target=self.restart)
+        thread.daemon = True
+        thread.start()
+
+    def restart(self):
+        try:
+            (readFd, writeFd) = os.pipe()
+            pid = os.fork()
+            if pid == 0:
+                self.__execSuccessor(writeFd)
+            os.close(writeFd)
+            try:
+                ready = select.select([readFd], [], [], RESTART_TIMEOUT)[0]
+                ready = ready and os.read(readFd, 1)
+            finally:
+                os.close(readFd)
+            if not ready:
+                log.error("New handler process %d did not start, keeping this one" % pid)
+                try:
+                    os.kill(pid, signal.SIGTERM)
+                    os.waitpid(pid, 0)
+                except OSError:
+                    pass
+                return
+            log.info("Handing over to handler process %d" % pid)
+            # Otherwise systemd stops the service once this process exits.
+            _sdNotify("MAINPID=%d" % pid)
+            VFSHandler.drainConnections()
+        finally:
+            self.restarting = False
+
+    # Runs in the forked child.  The listening socket becomes descriptor
+    # LISTEN_FDS_START; the other connections must not stay open in it.
+    def __execSuccessor(self, readyFd):
+        try:
+            if readyFd == LISTEN_FDS_START:
+                readyFd = os.dup(readyFd)
+            os.dup2(self.server.socket.fileno(), LISTEN_FDS_START)
+            try:
+                maxFd = os.sysconf("SC_OPEN_MAX")
+            except (AttributeError, ValueError):
+                maxFd = 1024
+            os.closerange(LISTEN_FDS_START + 1, readyFd)
+            os.closerange(readyFd + 1, maxFd)
+            os.environ["LISTEN_PID"] = str(os.getpid())
+            os.environ["LISTEN_FDS"] = "1"
+            os.environ["VFSX_READY_FD"] = str(readyFd)
+            os.execv(sys.executable, [sys.executable] + sys.argv)
+        finally:
+            os._exit(127)
+
+
+# A socket.recv() that isn't cut short by signals
+def _recv(sock, size):
+    while True:
+        try:
+            return sock.recv(size)
+        except socket.error, e:
+            if e.args[0] != errno.EINTR:
+                raise
+
+
+def _shutdownRead(sock):
+    try:
+        sock.shutdown(socket.SHUT_RD)
+    except socket.error:
+        # Already closed
+        pass
+
+
+# The listening socket passed in by a restarting handler or by systemd, or
+# None.
+def _inheritedListener():
+    if os.environ.get("LISTEN_PID") != str(os.getpid()):
+        return None
+    count = int(os.environ.pop("LISTEN_FDS", "0"))
+    del os.environ["LISTEN_PID"]
+    if count < 1:
+        return None
+    listener = socket.fromfd(LISTEN_FDS_START, socket.AF_UNIX, socket.SOCK_STREAM)
+    os.close(LISTEN_FDS_START)
+    return listener
+
+
+# Sends a state change to systemd when it runs the handler as a
+# Type=notify service, the way sd_notify() does.
+def _sdNotify(state):
+    path = os.environ.get("NOTIFY_SOCKET")
+    if not path:
+        return
+    if path[0] == "@":
+        path = "\0" + path[1:]
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+    try:
+        try:
+            sock.sendto(state, path)
+        except socket.error, e:
+            log.warning("Can't notify systemd: %s" % e)
+    finally:
+        sock.close()
+
+
+# Tells a restarting handler, or else systemd, that this process is serving.
+# After a restart the previous handler reports the new main PID instead, as
+# systemd only takes it from the process it knows.
+def _notifyReady():
+    readyFd = os.environ.pop("VFSX_READY_FD", None)
+    if readyFd is None:
+        _sdNotify("READY=1")
+        return
+    try:
+        os.write(int(readyFd), "1")
+        os.close(int(readyFd))
+    except OSError, e:
+        log.warning("Can't notify the previous handler: %s" % e)
+
+
+def _logError(excType, excValue, tb):
+    log.error(excValue, exc_info=(excType, excValue, tb))
+
+
+def _eventsLost(origpath, pid, first, last):
+    try:
+        VFSModuleSession.getSession(origpath).eventsLost(pid, first, last)
+    except Exception, e:
+        log.exception(e)
+
+
+def runServer(vfsSessionClass, batched=False, workers=0):
     log.info("Starting socket server using session class '%s.%s'"
              % (vfsSessionClass.__module__, vfsSessionClass.__name__))
-    if os.path.exists(SOCKET_FILE):
-        os.unlink(SOCKET_FILE)
+    if batched:
+        socketFile = HANDLER_SOCKET_FILE
+    else:
+        socketFile = SOCKET_FILE
+    # Clients keep connecting to an inherited socket while we start up.
+    listener = _inheritedListener()
+    if listener is None and os.path.exists(socketFile):
+        os.unlink(socketFile)
     VFSModuleSession.setSessionClass(vfsSessionClass)
-    server = SocketServer.UnixStreamServer(SOCKET_FILE, VFSHandler)
+    if batched:
+        # A few long-lived broker links, each served by its own thread.
+        if workers > 0:
+            VFSBatchHandler.workerPool = VFSWorkerPool(workers)
+        server = SocketServer.ThreadingUnixStreamServer(socketFile, VFSBatchHandler,
+                                                        listener is None)
+        server.daemon_threads = True
+    elif workers > 0:
+        # One thread per smbd, each answering its messages in order, with at
+        # most workers of them running operations at a time.
+        VFSHandler.slots = threading.BoundedSemaphore(workers)
+        server = SocketServer.ThreadingUnixStreamServer(socketFile, VFSHandler,
+                                                        listener is None)
+        server.daemon_threads = True
+    else:
+        server = SocketServer.UnixStreamServer(socketFile, VFSHandler, listener is None)
+    if listener is not None:
+        server.socket.close()
+        server.socket = listener
+    VFSRestart(server)
+    _notifyReady()
+    # Serve until a successor takes over (see VFSRestart).  Connections it
+    # would have accepted are left to the successor.
     try:
-        server.serve_forever()
+        while not VFSHandler.draining:
+            try:
+                readable = select.select([server], [], [], 0.5)[0]
+            except select.error, e:
+                if e.args[0] != errno.EINTR:
+                    raise
+                continue
+            if readable and not VFSHandler.draining:
+                server._handle_request_noblock()
     except Exception, e:
         log.info("Socket server stopped due to exception '%s'" % e.__class__)
+        return
+    server.server_close()
+    if not VFSHandler.waitForConnections(RESTART_TIMEOUT):
+        log.warning("Exiting with connections still open")
+    log.info("Handler process %d done" % os.getpid())
 
 
 # Initialize default VFSModuleSession class
@@ -214,14 +801,29 @@ VFSModuleSession.setSessionClass(VFSModuleSession)
 
 if __name__ == "__main__":
 
+    # With --batched, serve broker links on HANDLER_SOCKET_FILE instead of
+    # the module connections on SOCKET_FILE.  --workers=N runs the operations
+    # of the links on N threads, ordered per file, or those of up to N module
+    # connections at once, ordered per connection.  The threads share the
+    # interpreter lock, so they overlap waits but not computation.
+    args = sys.argv[1:]
+    batched = "--batched" in args
+    if batched:
+        args.remove("--batched")
+    workers = 0
+    for arg in args[:]:
+        if arg.startswith("--workers="):
+            workers = int(arg[len("--workers="):])
+            args.remove(arg)
+
     # If no args given, handle requests with the base VFSModuleSession class.
-    if len(sys.argv) == 1:
-        runServer(VFSModuleSession)
+    if len(args) == 0:
+        runServer(VFSModuleSession, batched, workers)
     # If 2 args are provided, treat them as the module name and class name of
     # the VFSModuleSession subclass to use for handling requests.
     else:
-        modulename = sys.argv[1]
-        clsname = sys.argv[2]
+        modulename = args[0]
+        clsname = args[1]
         module = __import__(modulename, globals(), locals(), [clsname])
         cls = vars(module)[clsname]
-        runServer(cls)
+        runServer(cls, batched, workers)
@@ -0,0 +1,352 @@
+#
+# Local event broker.  Accepts the connections of all smbd processes on the
+# module socket, merges their messages into batches and forwards them over a
+# few persistent links to a handler started with "vfsx.py --batched".
+# Replies are routed back by request ID, in the order each smbd sent its
+# messages.
+#
+# Usage: python vfsx_broker.py [--socket PATH] [--handler PATH] [--links N]
+#
+import os
+import sys
+import time
+import errno
+import socket
+import select
+import struct
+import logging
+import optparse
+import collections
+
+# The Unix domain socket file the module connects to
+SOCKET_FILE = "/tmp/vfsx-socket"
+
+# The Unix domain socket file of the batched handler
+HANDLER_SOCKET_FILE = "/tmp/vfsx-handler-socket"
+
+# Wire format used by the VFSX module
+MSG_OUT_SIZE = 512
+MSG_IN_SIZE = 3
+
+# Link framing, see VFSBatchHandler in vfsx.py
+REQUEST_ID = struct.Struct("!I")
+BATCH_REQUEST_SIZE = REQUEST_ID.size + MSG_OUT_SIZE
+BATCH_REPLY_SIZE = REQUEST_ID.size + MSG_IN_SIZE
+
+# Reply given when no handler link can take a message
+TRANSPARENT_REPLY = "0".ljust(MSG_IN_SIZE, "\0")
+
+RECV_SIZE = 65536
+RECONNECT_INTERVAL = 1.0
+
+logging.basicConfig()
+log = logging.getLogger("vfsx.broker")
+log.setLevel(logging.INFO)
+
+
+# Size of the reply at offset in data, whose first MSG_IN_SIZE bytes must be
+# there.  A reply with I/O hints is "H", the payload length in two hex digits
+# and the payload.
+def replySize(data, offset):
+    if data[offset] != "H":
+        return MSG_IN_SIZE
+    return MSG_IN_SIZE + int(data[offset + 1:offset + MSG_IN_SIZE], 16)
+
+
+class Endpoint(object):
+
+    def __init__(self, sock):
+        self.sock = sock
+        self.sock.setblocking(0)
+        self.fd = sock.fileno()
+        self.inbuf = ""
+        self.outbuf = ""
+        self.writing = False
+        self.closed = False
+
+    def fileno(self):
+        return self.fd
+
+
+# One smbd connection.  "pending" holds its request IDs in send order and
+# "replies" the replies that arrived ahead of an earlier request.
+class Client(Endpoint):
+
+    def __init__(self, sock, link):
+        Endpoint.__init__(self, sock)
+        self.link = link
+        self.pending = collections.deque()
+        self.replies = {}
+
+
+# One persistent connection to the handler.  "requests" maps the request IDs
+# in flight on the link to their client.
+class Link(Endpoint):
+
+    def __init__(self, sock, index):
+        Endpoint.__init__(self, sock)
+        self.index = index
+        self.requests = {}
+
+
+class Broker(object):
+
+    def __init__(self, socketFile, handlerFile, linkCount):
+        self.socketFile = socketFile
+        self.handlerFile = handlerFile
+        self.linkCount = linkCount
+        self.epoll = select.epoll()
+        self.endpoints = {}
+        self.dirty = set()
+        self.links = [None] * linkCount
+        self.lastConnect = 0
+        self.nextId = 0
+        self.nextLink = 0
+        self.listener = None
+
+    def listen(self):
+        if os.path.exists(self.socketFile):
+            os.unlink(self.socketFile)
+        self.listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.listener.bind(self.socketFile)
+        self.listener.listen(128)
+        self.listener.setblocking(0)
+        self.epoll.register(self.listener.fileno(), select.EPOLLIN)
+
+    def connectLinks(self):
+        self.lastConnect = time.time()
+        for i in range(self.linkCount):
+            if self.links[i] is not None:
+                continue
+            sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            try:
+                sock.connect(self.handlerFile)
+            except socket.error, e:
+                sock.close()
+                log.warning("Can't connect link %d: %s" % (i, e))
+                continue
+            link = Link(sock, i)
+            self.links[i] = link
+            self.endpoints[link.fileno()] = link
+            self.epoll.register(link.fileno(), select.EPOLLIN)
+            log.info("Link %d connected" % i)
+
+    # Clients are spread over the links round robin.  A client stays on its
+    # link, so the handler sees its messages in order.
+    def pickLink(self):
+        for i in range(self.linkCount):
+            link = self.links[(self.nextLink + i) % self.linkCount]
+            if link is not None:
+                self.nextLink = (link.index + 1) % self.linkCount
+                return link
+        return None
+
+    def accept(self):
+        while True:
+            try:
+                (sock, addr) = self.listener.accept()
+            except socket.error, e:
+                if e.args[0] in (errno.EAGAIN, errno.EWOULDBLOCK):
+                    return
+                raise
+            client = Client(sock, self.pickLink())
+            self.endpoints[client.fileno()] = client
+            self.epoll.register(client.fileno(), select.EPOLLIN)
+
+    def readClient(self, client):
+        if not self.receive(client):
+            self.closeClient(client)
+            return
+        count = len(client.inbuf) // MSG_OUT_SIZE
+        for i in range(count):
+            msg = client.inbuf[i * MSG_OUT_SIZE:(i + 1) * MSG_OUT_SIZE]
+            self.forward(client, msg)
+        client.inbuf = client.inbuf[count * MSG_OUT_SIZE:]
+
+    def forward(self, client, msg):
+        requestId = self.nextId
+        self.nextId = (self.nextId + 1) & 0xffffffff
+        client.pending.append(requestId)
+        self.route(client, requestId, msg)
+
+    def route(self, client, requestId, msg):
+        if client.link is None or self.links[client.link.index] is not client.link:
+            client.link = self.pickLink()
+        if client.link is None:
+            client.replies[requestId] = TRANSPARENT_REPLY
+            self.deliver(client)
+            return
+        client.link.requests[requestId] = client
+        client.link.outbuf += REQUEST_ID.pack(requestId) + msg
+        self.dirty.add(client.link)
+
+    def readLink(self, link):
+        if not self.receive(link):
+            self.closeLink(link)
+            return
+        inbuf = link.inbuf
+        pos = 0
+        touched = set()
+        while len(inbuf) - pos >= BATCH_REPLY_SIZE:
+            size = REQUEST_ID.size + replySize(inbuf, pos + REQUEST_ID.size)
+            if len(inbuf) - pos < size:
+                break
+            (requestId,) = REQUEST_ID.unpack(inbuf[pos:pos + REQUEST_ID.size])
+            reply = inbuf[pos + REQUEST_ID.size:pos + size]
+            pos += size
+            client = link.requests.pop(requestId, None)
+            # The smbd may have gone away in the meantime.
+            if client is None or client.closed:
+                continue
+            client.replies[requestId] = reply
+            touched.add(client)
+        link.inbuf = inbuf[pos:]
+        for client in touched:
+            self.deliver(client)
+
+    # Queues the replies that are next in line for the client.
+    def deliver(self, client):
+        while client.pending and client.pending[0] in client.replies:
+            client.outbuf += client.replies.pop(client.pending.popleft())
+            self.dirty.add(client)
+
+    def receive(self, endpoint):
+        try:
+            data = endpoint.sock.recv(RECV_SIZE)
+        except socket.error, e:
+            if e.args[0] in (errno.EAGAIN, errno.EWOULDBLOCK, errno.EINTR):
+                return True
+            return False
+        if not data:
+            return False
+        endpoint.inbuf += data
+        return True
+
+    # Sends what the endpoint has queued.  All messages merged into a link's
+    # buffer during one loop iteration go out with a single send.
+    def flush(self, endpoint):
+        if endpoint.outbuf:
+            try:
+                sent = endpoint.sock.send(endpoint.outbuf)
+                endpoint.outbuf = endpoint.outbuf[sent:]
+            except socket.error, e:
+                if e.args[0] not in (errno.EAGAIN, errno.EWOULDBLOCK, errno.EINTR):
+                    return False
+        writing = len(endpoint.outbuf) > 0
+        if writing != endpoint.writing:
+            endpoint.writing = writing
+            if writing:
+                self.epoll.modify(endpoint.fileno(), select.EPOLLIN | select.EPOLLOUT)
+            else:
+                self.epoll.modify(endpoint.fileno(), select.EPOLLIN)
+        return True
+
+    # Requests still in flight for the client are dropped when their reply
+    # comes back.
+    def closeClient(self, client):
+        self.unregister(client)
+
+    # The handler stopped reading from the link, as a restarting handler
+    # does once its successor serves.  Replies to what it got are read until
+    # the link closes.
+    def drainLink(self, link):
+        log.info("Link %d draining" % link.index)
+        self.releaseLink(link)
+        self.flush(link)
+
+    # Takes the link out of service.  The requests it never sent go out on
+    # another link.
+    def releaseLink(self, link):
+        if self.links[link.index] is link:
+            self.links[link.index] = None
+        self.connectLinks()
+        outbuf = link.outbuf
+        link.outbuf = ""
+        # A request sent in part can't be taken back and is lost.
+        pos = len(outbuf) % BATCH_REQUEST_SIZE
+        while pos < len(outbuf):
+            (requestId,) = REQUEST_ID.unpack(outbuf[pos:pos + REQUEST_ID.size])
+            msg = outbuf[pos + REQUEST_ID.size:pos + BATCH_REQUEST_SIZE]
+            pos += BATCH_REQUEST_SIZE
+            client = link.requests.pop(requestId, None)
+            if client is not None and not client.closed:
+                self.route(client, requestId, msg)
+
+    # Requests lost with a link are answered as transparent, the way the
+    # module itself behaves when the handler is gone.
+    def closeLink(self, link):
+        log.warning("Link %d closed" % link.index)
+        self.releaseLink(link)
+        self.unregister(link)
+        for (requestId, client) in link.requests.items():
+            if not client.closed:
+                client.replies[requestId] = TRANSPARENT_REPLY
+                self.deliver(client)
+
+    def unregister(self, endpoint):
+        if endpoint.closed:
+            return
+        endpoint.closed = True
+        del self.endpoints[endpoint.fileno()]
+        self.epoll.unregister(endpoint.fileno())
+        self.dirty.discard(endpoint)
+        endpoint.sock.close()
+
+    def run(self):
+        self.listen()
+        self.connectLinks()
+        log.info("Broker listening on %s, handler at %s"
+                 % (self.socketFile, self.handlerFile))
+        while True:
+            if None in self.links and time.time() - self.lastConnect > RECONNECT_INTERVAL:
+                self.connectLinks()
+            if self.dirty:
+                timeout = 0
+            else:
+                timeout = RECONNECT_INTERVAL
+            try:
+                events = self.epoll.poll(timeout)
+            except IOError, e:
+                if e.errno == errno.EINTR:
+                    continue
+                raise
+            for (fd, event) in events:
+                if fd == self.listener.fileno():
+                    self.accept()
+                    continue
+                endpoint = self.endpoints.get(fd)
+                if endpoint is None:
+                    continue
+                if event & select.EPOLLOUT:
+                    self.dirty.add(endpoint)
+                if event & (select.EPOLLIN | select.EPOLLHUP | select.EPOLLERR):
+                    if isinstance(endpoint, Link):
+                        self.readLink(endpoint)
+                    else:
+                        self.readClient(endpoint)
+            dirty = self.dirty
+            self.dirty = set()
+            for endpoint in dirty:
+                if endpoint.closed:
+                    continue
+                if not self.flush(endpoint):
+                    if isinstance(endpoint, Link):
+                        self.drainLink(endpoint)
+                    else:
+                        self.closeClient(endpoint)
+
+
+if __name__ == "__main__":
+    parser = optparse.OptionParser(usage="%prog [options]")
+    parser.add_option("-s", "--socket", dest="socket", default=SOCKET_FILE,
+                      help="socket the module connects to (default %s)" % SOCKET_FILE)
+    parser.add_option("-H", "--handler", dest="handler", default=HANDLER_SOCKET_FILE,
+                      help="batched handler socket (default %s)" % HANDLER_SOCKET_FILE)
+    parser.add_option("-l", "--links", dest="links", type="int", default=2,
+                      help="number of handler links (default 2)")
+    (options, args) = parser.parse_args()
+    broker = Broker(options.socket, options.handler, options.links)
+    try:
+        broker.run()
+    except KeyboardInterrupt:
+        pass
@@ -0,0 +1,121 @@
+#
+# Reads the change journal written by the VFSX module (see "vfsx:journal
+# file").  A cursor is a byte offset into the journal: start from 0, keep the
+# cursor returned with the changes and pass it in next time to get only what
+# changed since.
+#
+# Usage: python vfsx_journal.py [--cursor N] [--records] JOURNAL
+#
+import os
+import sys
+import struct
+import optparse
+
+# Journal file layout: magic, then records of (usec, length, type) + paths
+JOURNAL_MAGIC = "VFSXJNL1"
+RECORD_HEADER = struct.Struct("<QIc3x")
+
+# Record types
+CHANGE_DATA = "M"
+CHANGE_META = "A"
+CHANGE_CREATE = "C"
+CHANGE_DELETE = "D"
+CHANGE_RENAME = "R"
+
+
+class ChangeRecord(object):
+
+    def __init__(self, usec, change, path, newPath=None):
+        self.usec = usec
+        self.change = change
+        self.path = path
+        self.newPath = newPath
+
+    def __str__(self):
+        if self.newPath is not None:
+            return "%d %s %s %s" % (self.usec, self.change, self.path, self.newPath)
+        return "%d %s %s" % (self.usec, self.change, self.path)
+
+
+# Yields (record, cursor) for every complete record after cursor, where
+# cursor is the offset past the record.  A record still being written ends
+# the iteration.
+def readJournal(path, cursor=0):
+    f = open(path, "rb")
+    try:
+        f.seek(0, os.SEEK_END)
+        if cursor > f.tell():
+            raise ValueError("cursor %d is past the end of %s" % (cursor, path))
+        f.seek(cursor)
+        while True:
+            header = f.read(RECORD_HEADER.size)
+            if len(header) < RECORD_HEADER.size:
+                break
+            # Several smbd processes may have created the file at once.
+            if header[:len(JOURNAL_MAGIC)] == JOURNAL_MAGIC:
+                f.seek(len(JOURNAL_MAGIC) - RECORD_HEADER.size, 1)
+                cursor += len(JOURNAL_MAGIC)
+                continue
+            (usec, length, change) = RECORD_HEADER.unpack(header)
+            payload = f.read(length)
+            if len(payload) < length:
+                break
+            paths = payload.split("\0")
+            cursor += RECORD_HEADER.size + length
+            if change == CHANGE_RENAME:
+                yield (ChangeRecord(usec, change, paths[0], paths[1]), cursor)
+            else:
+                yield (ChangeRecord(usec, change, paths[0]), cursor)
+    finally:
+        f.close()
+
+
+# Folds the records after cursor into the paths that changed and the paths
+# that are gone, and returns (changed, deleted, cursor).  A renamed directory
+# only shows up under its new name; its contents must be rescanned.
+#
+# Each smbd process appends its records when it flushes, so a record can
+# land behind later records of other processes.  The records are folded in
+# the order of their timestamps instead of their order in the file.
+def changesSince(path, cursor=0):
+    changed = set()
+    deleted = set()
+    records = []
+    for (record, cursor) in readJournal(path, cursor):
+        records.append(record)
+    records.sort(key=lambda record: record.usec)
+    for record in records:
+        if record.change == CHANGE_DELETE:
+            changed.discard(record.path)
+            deleted.add(record.path)
+        elif record.change == CHANGE_RENAME:
+            changed.discard(record.path)
+            deleted.add(record.path)
+            deleted.discard(record.newPath)
+            changed.add(record.newPath)
+        else:
+            deleted.discard(record.path)
+            changed.add(record.path)
+    return (changed, deleted, cursor)
+
+
+if __name__ == "__main__":
+    parser = optparse.OptionParser(usage="%prog [options] JOURNAL")
+    parser.add_option("-c", "--cursor", dest="cursor", type="long", default=0,
+                      help="only report changes after this cursor (default 0)")
+    parser.add_option("-r", "--records", dest="records", action="store_true",
+                      default=False, help="print the raw records")
+    (options, args) = parser.parse_args()
+    if len(args) != 1:
+        parser.error("expected exactly one journal file")
+    cursor = options.cursor
+    if options.records:
+        for (record, cursor) in readJournal(args[0], cursor):
+            sys.stdout.write("%s\n" % record)
+    else:
+        (changed, deleted, cursor) = changesSince(args[0], cursor)
+        for path in sorted(changed):
+            sys.stdout.write("changed %s\n" % path)
+        for path in sorted(deleted):
+            sys.stdout.write("deleted %s\n" % path)
+    sys.stdout.write("cursor %d\n" % cursor)
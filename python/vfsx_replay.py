@@ -0,0 +1,195 @@
+#
+# Replays a VFSX trace file (see "vfsx:trace file") against a handler socket
+# and reports the handler's throughput and reply latency distribution.  The
+# events of each recorded smbd process are sent on a connection of their
+# own, as the module would, so the handler sees the recorded concurrency.
+#
+# Usage: python vfsx_replay.py [--socket PATH] [--speed N|max] TRACEFILE
+#
+import sys
+import time
+import struct
+import socket
+import optparse
+import threading
+
+# Wire format used by the VFSX module
+MSG_OUT_SIZE = 512
+MSG_IN_SIZE = 3
+
+# The Unix domain socket file
+SOCKET_FILE = "/tmp/vfsx-socket"
+
+# Trace file layout: magic, then records of (usec, pid, length) + message
+TRACE_MAGIC = "VFSXTRC1"
+TRACE_HEADER = struct.Struct("<QII")
+
+
+class TraceRecord(object):
+
+    def __init__(self, usec, pid, msg):
+        self.usec = usec
+        self.pid = pid
+        self.msg = msg
+
+    def __str__(self):
+        return "%d %d %s" % (self.usec, self.pid, self.msg)
+
+
+def readTrace(path):
+    f = open(path, "rb")
+    try:
+        while True:
+            header = f.read(TRACE_HEADER.size)
+            if len(header) < TRACE_HEADER.size:
+                break
+            # Several smbd processes may have created the file at once.
+            if header[:len(TRACE_MAGIC)] == TRACE_MAGIC:
+                f.seek(len(TRACE_MAGIC) - TRACE_HEADER.size, 1)
+                continue
+            (usec, pid, length) = TRACE_HEADER.unpack(header)
+            msg = f.read(length)
+            if len(msg) < length:
+                break
+            yield TraceRecord(usec, pid, msg)
+    finally:
+        f.close()
+
+
+def percentile(values, pct):
+    if not values:
+        return 0
+    index = int(round(pct / 100.0 * (len(values) - 1)))
+    return values[index]
+
+
+class ReplayStats(object):
+
+    def __init__(self):
+        self.latencies = []
+        self.statuses = {}
+        self.started = None
+        self.finished = None
+        self.errors = []
+        self.lock = threading.Lock()
+
+    def record(self, latency, status):
+        self.lock.acquire()
+        try:
+            self.latencies.append(latency)
+            self.statuses[status] = self.statuses.get(status, 0) + 1
+        finally:
+            self.lock.release()
+
+    def report(self, out):
+        events = len(self.latencies)
+        elapsed = (self.finished or time.time()) - (self.started or time.time())
+        latencies = sorted(self.latencies)
+        out.write("events:     %d\n" % events)
+        out.write("elapsed:    %.3f s\n" % elapsed)
+        if elapsed > 0:
+            out.write("throughput: %.1f events/s\n" % (events / elapsed))
+        out.write("latency (usec):\n")
+        for pct in (50, 90, 99, 99.9):
+            out.write("  p%-5s %10.1f\n" % (pct, percentile(latencies, pct)))
+        if latencies:
+            out.write("  max    %10.1f\n" % latencies[-1])
+            out.write("  mean   %10.1f\n" % (sum(latencies) / events))
+        out.write("replies:\n")
+        for status in sorted(self.statuses):
+            out.write("  %-6s %d\n" % (status, self.statuses[status]))
+        for error in self.errors:
+            out.write("error: %s\n" % error)
+
+
+def recvAll(sock, size):
+    data = ""
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        if not chunk:
+            raise IOError("handler closed the connection")
+        data += chunk
+    return data
+
+
+# Reads a reply the way the module does: one read of up to MSG_IN_SIZE bytes
+# holding the status as a decimal string, since handlers may send it
+# unpadded.  Only a reply with I/O hints ("H", payload length in hex,
+# "status:hints") is read to its end.
+def recvReply(sock):
+    reply = sock.recv(MSG_IN_SIZE)
+    if not reply:
+        raise IOError("handler closed the connection")
+    if reply[0] == "H":
+        reply += recvAll(sock, MSG_IN_SIZE - len(reply))
+        payload = recvAll(sock, int(reply[1:], 16))
+        return payload.split(":")[0]
+    return reply.rstrip("\0")
+
+
+# Sends the records of one smbd process over its own connection, each one
+# once the previous reply is in, as the module does.
+def replayProcess(records, socketFile, speed, firstUsec, stats):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        sock.connect(socketFile)
+        for record in records:
+            if speed > 0:
+                due = stats.started + (record.usec - firstUsec) / 1e6 / speed
+                delay = due - time.time()
+                if delay > 0:
+                    time.sleep(delay)
+            msg = record.msg[:MSG_OUT_SIZE - 1]
+            sent = time.time()
+            sock.sendall(msg + "\0" * (MSG_OUT_SIZE - len(msg)))
+            status = recvReply(sock)
+            stats.record((time.time() - sent) * 1e6, status)
+    except (IOError, socket.error), e:
+        stats.errors.append("pid %d: %s" % (records[0].pid, e))
+    finally:
+        sock.close()
+
+
+# Feeds the trace into the handler, one connection per recorded smbd
+# process.  A speed of 1.0 keeps the recorded spacing between events, N
+# compresses it N times and 0 sends as fast as the handler replies.
+def replay(path, socketFile, speed):
+    stats = ReplayStats()
+    processes = {}
+    firstUsec = None
+    for record in readTrace(path):
+        if firstUsec is None:
+            firstUsec = record.usec
+        processes.setdefault(record.pid, []).append(record)
+    threads = []
+    for records in processes.values():
+        thread = threading.Thread(target=replayProcess,
+                                  args=(records, socketFile, speed, firstUsec, stats))
+        thread.daemon = True
+        threads.append(thread)
+    stats.started = time.time()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        # A timeout keeps Ctrl-C working while waiting.
+        while thread.isAlive():
+            thread.join(1.0)
+    stats.finished = time.time()
+    return stats
+
+
+if __name__ == "__main__":
+    parser = optparse.OptionParser(usage="%prog [options] TRACEFILE")
+    parser.add_option("-s", "--socket", dest="socket", default=SOCKET_FILE,
+                      help="handler socket (default %s)" % SOCKET_FILE)
+    parser.add_option("-x", "--speed", dest="speed", default="1",
+                      help="replay speed factor, or 'max' (default 1)")
+    (options, args) = parser.parse_args()
+    if len(args) != 1:
+        parser.error("expected exactly one trace file")
+    if options.speed == "max":
+        speed = 0
+    else:
+        speed = float(options.speed)
+    stats = replay(args[0], options.socket, speed)
+    stats.report(sys.stdout)
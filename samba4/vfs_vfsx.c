@@ -38,6 +38,10 @@
 #undef DBGC_CLASS
 #define DBGC_CLASS DBGC_VFS
 
+#if defined(HAVE_LINUX_READAHEAD) && ! defined(HAVE_READAHEAD_DECL)
+ssize_t readahead(int fd, off_t offset, size_t count);
+#endif
+
 #define VFSX_MSG_OUT_SIZE 512
 #define VFSX_MSG_IN_SIZE 3
 #define VFSX_FAIL_ERROR -1
@@ -45,135 +49,1674 @@
 #define VFSX_SUCCESS_TRANSPARENT 0
 #define VFSX_SOCKET_FILE "/tmp/vfsx-socket"
 #define VFSX_LOG_FILE "/tmp/vfsx.log"
+#define VFSX_TRACE_MAGIC "VFSXTRC1"
+#define VFSX_TRACE_HDR_SIZE 16
+#define VFSX_PENDING_MAX 64
+#define VFSX_LATENCY_WINDOW 100
+#define VFSX_PROBE_INTERVAL_USEC 100000
+#define VFSX_HOLD_MAX 64
+#define VFSX_HINTS_MAX 255
+#define VFSX_HINT_RANGES 8
+#define VFSX_JOURNAL_MAGIC "VFSXJNL1"
+#define VFSX_JOURNAL_HDR_SIZE 16
+#define VFSX_JOURNAL_BUCKETS 256
+#define VFSX_JOURNAL_BUF_SIZE 65536
+#define VFSX_USAGE_USERS 16
+
+/* Per-connection module state, read from the share's vfsx:* parameters */
+
+struct vfsx_trie_node;
+struct vfsx_journal;
+
+struct vfsx_config {
+	int trace_fd;
+	struct vfsx_journal *journal;	/* NULL when changes are not tracked */
+	struct vfsx_accounting *accounting;	/* NULL when usage is not counted */
+	bool io_events;			/* forward read and write events */
+	bool event_info;		/* stamp events with "seq,pid,key" */
+	const char *connectpath;
+	struct vfsx_trie_node *include;	/* NULL when every path is wanted */
+	struct vfsx_trie_node *exclude;
+	uint32_t slo_usec;		/* 0 keeps the link synchronous */
+	uint32_t slo_timeout_usec;
+	int slo_percentile;
+	int sample_rate;
+	unsigned int hold_max;		/* events held while the handler is away */
+};
 
  /* VFSX communication functions */
 
-static void vfsx_write_file(const char *str)
+static void vfsx_write_file(const char *str)
+{
+	int fd;
+
+	fd = open(VFSX_LOG_FILE, O_RDWR | O_APPEND);
+	if (fd != -1) {
+		write(fd, str, strlen(str));
+		write(fd, "\n", 1);
+		close(fd);
+	}
+	else {
+		syslog(LOG_NOTICE, "vfsx_write_file can't write");
+	}
+}
+
+/*
+ * I/O hints.  The reply to an open or create may carry hints instead of the
+ * bare status: "H" and two hex digits giving the length of a payload of the
+ * form "status:hint,hint".  A hint is "normal", "sequential", "random" or
+ * "noreuse" for the whole file, or "willneed", "dontneed" or "readahead"
+ * with an optional "=offset+length" range (length 0 is up to the end of the
+ * file).  "noreuse" also drops the file's cached pages at close.  The hints
+ * are only applied when the module waits for the reply.
+ */
+
+enum vfsx_hint_op {
+	VFSX_HINT_NORMAL,
+	VFSX_HINT_SEQUENTIAL,
+	VFSX_HINT_RANDOM,
+	VFSX_HINT_NOREUSE,
+	VFSX_HINT_WILLNEED,
+	VFSX_HINT_DONTNEED,
+	VFSX_HINT_READAHEAD
+};
+
+static const char *vfsx_hint_names[] = {
+	"normal", "sequential", "random", "noreuse", "willneed", "dontneed", "readahead"
+};
+
+struct vfsx_hints {
+	unsigned int count;
+	struct {
+		enum vfsx_hint_op op;
+		off_t offset;
+		off_t len;
+	} hint[VFSX_HINT_RANGES];
+};
+
+/* Per open file state, kept as an fsp extension */
+struct vfsx_fsp {
+	bool noreuse;
+};
+
+/* Parses the comma separated hints of a reply, skipping the unknown ones */
+static void vfsx_parse_hints(const char *text, struct vfsx_hints *hints)
+{
+	const char *end;
+	char *stop;
+	size_t len;
+	unsigned int i;
+
+	hints->count = 0;
+	while (*text != '\0' && hints->count < VFSX_HINT_RANGES) {
+		end = strchr(text, ',');
+		if (end == NULL) {
+			end = text + strlen(text);
+		}
+		len = strcspn(text, "=,");
+		for (i = 0; i < ARRAY_SIZE(vfsx_hint_names); i++) {
+			if (strlen(vfsx_hint_names[i]) == len && strncmp(text, vfsx_hint_names[i], len) == 0) {
+				break;
+			}
+		}
+		if (i < ARRAY_SIZE(vfsx_hint_names)) {
+			hints->hint[hints->count].op = (enum vfsx_hint_op)i;
+			hints->hint[hints->count].offset = 0;
+			hints->hint[hints->count].len = 0;
+			if (text[len] == '=') {
+				hints->hint[hints->count].offset = strtoll(text + len + 1, &stop, 10);
+				if (*stop == '+') {
+					hints->hint[hints->count].len = strtoll(stop + 1, NULL, 10);
+				}
+			}
+			hints->count++;
+		}
+		text = *end == ',' ? end + 1 : end;
+	}
+}
+
+static void vfsx_fadvise(int fd, off_t offset, off_t len, enum vfsx_hint_op op)
+{
+#if defined(HAVE_POSIX_FADVISE)
+	static const int advice[] = {
+		[VFSX_HINT_NORMAL] = POSIX_FADV_NORMAL,
+		[VFSX_HINT_SEQUENTIAL] = POSIX_FADV_SEQUENTIAL,
+		[VFSX_HINT_RANDOM] = POSIX_FADV_RANDOM,
+		[VFSX_HINT_NOREUSE] = POSIX_FADV_NOREUSE,
+		[VFSX_HINT_WILLNEED] = POSIX_FADV_WILLNEED,
+		[VFSX_HINT_DONTNEED] = POSIX_FADV_DONTNEED,
+		[VFSX_HINT_READAHEAD] = POSIX_FADV_WILLNEED
+	};
+	int err;
+
+	err = posix_fadvise(fd, offset, len, advice[op]);
+	if (err != 0) {
+		syslog(LOG_NOTICE, "vfsx_fadvise %s failed: %s", vfsx_hint_names[op], strerror(err));
+	}
+#endif
+}
+
+static void vfsx_apply_hints(vfs_handle_struct *handle, files_struct *fsp, int fd,
+			     const struct vfsx_hints *hints)
+{
+	struct vfsx_fsp *ext;
+	unsigned int i;
+
+	if (fd == -1) {
+		return;
+	}
+	for (i = 0; i < hints->count; i++) {
+		switch (hints->hint[i].op) {
+		case VFSX_HINT_NOREUSE:
+			ext = VFS_FETCH_FSP_EXTENSION(handle, fsp);
+			if (ext == NULL) {
+				ext = VFS_ADD_FSP_EXTENSION(handle, fsp, struct vfsx_fsp, NULL);
+			}
+			if (ext != NULL) {
+				ext->noreuse = true;
+			}
+			vfsx_fadvise(fd, 0, 0, VFSX_HINT_NOREUSE);
+			break;
+		case VFSX_HINT_READAHEAD:
+#if defined(HAVE_LINUX_READAHEAD)
+			if (readahead(fd, hints->hint[i].offset, (size_t)hints->hint[i].len) == -1) {
+				syslog(LOG_NOTICE, "vfsx_apply_hints readahead failed: %s", strerror(errno));
+			}
+#else
+			vfsx_fadvise(fd, hints->hint[i].offset, hints->hint[i].len, VFSX_HINT_READAHEAD);
+#endif
+			break;
+		default:
+			vfsx_fadvise(fd, hints->hint[i].offset, hints->hint[i].len, hints->hint[i].op);
+			break;
+		}
+	}
+}
+
+/* Size of the reply whose first VFSX_MSG_IN_SIZE bytes are in buf */
+static size_t vfsx_reply_size(const char *buf)
+{
+	char hex[3];
+
+	if (buf[0] != 'H') {
+		return VFSX_MSG_IN_SIZE;
+	}
+	hex[0] = buf[1];
+	hex[1] = buf[2];
+	hex[2] = '\0';
+	return VFSX_MSG_IN_SIZE + strtoul(hex, NULL, 16);
+}
+
+/* Returns the status of a complete reply and fills in its hints, if wanted */
+static int vfsx_reply_status(const char *buf, size_t len, struct vfsx_hints *hints)
+{
+	char text[VFSX_HINTS_MAX + 1];
+	char *sep;
+
+	if (len < VFSX_MSG_IN_SIZE || buf[0] != 'H') {
+		len = MIN(len, VFSX_MSG_IN_SIZE);
+		memcpy(text, buf, len);
+		text[len] = '\0';
+		return atoi(text);
+	}
+	len -= VFSX_MSG_IN_SIZE;
+	memcpy(text, buf + VFSX_MSG_IN_SIZE, len);
+	text[len] = '\0';
+	sep = strchr(text, ':');
+	if (sep != NULL && hints != NULL) {
+		vfsx_parse_hints(sep + 1, hints);
+	}
+	return atoi(text);
+}
+
+/*
+ * The handler link is shared by every connection of this smbd.  Without an
+ * SLO it is the plain blocking exchange of one message and one reply.  With
+ * vfsx:slo usec set, the round trip latency is tracked over a window of
+ * samples and the link steps down from sync to async (replies are collected
+ * later), to sampling (one event in vfsx:sample rate) and to bypass (one
+ * probe per interval), and back up once the handler is fast again.  The
+ * adaptive mode needs replies padded to VFSX_MSG_IN_SIZE bytes so pipelined
+ * replies can be told apart.
+ *
+ * An event that can't be written is held in a small ring (vfsx:reconnect
+ * buffer) and sent ahead of the next one once the link is back.  A handler
+ * that restarts hands its listening socket to its successor and shuts down
+ * the reading side of our connection, so a failed write reconnects at once.
+ */
+
+enum vfsx_level {
+	VFSX_LEVEL_SYNC,
+	VFSX_LEVEL_ASYNC,
+	VFSX_LEVEL_SAMPLE,
+	VFSX_LEVEL_BYPASS
+};
+
+static const char *vfsx_level_names[] = { "sync", "async", "sample", "bypass" };
+
+struct vfsx_link_stats {
+	uint64_t degraded;
+	uint64_t recovered;
+	uint64_t sampled_out;
+	uint64_t bypassed;
+	uint64_t dropped;
+	uint64_t timeouts;
+};
+
+struct vfsx_link {
+	int sd;
+	int connected;
+	enum vfsx_level level;
+	/* send times of the messages still waiting for a reply, oldest first */
+	uint64_t pending[VFSX_PENDING_MAX];
+	unsigned int pending_head;
+	unsigned int pending_count;
+	/* a partially read reply */
+	char in[VFSX_MSG_IN_SIZE + VFSX_HINTS_MAX];
+	unsigned int in_len;
+	/* when the socket was last seen without a reply */
+	uint64_t checked;
+	/* latency window and how many of its samples exceed the SLO and half of it */
+	uint32_t window[VFSX_LATENCY_WINDOW];
+	unsigned int window_pos;
+	unsigned int window_count;
+	unsigned int over_slo;
+	unsigned int over_half;
+	uint64_t sample_count;
+	uint64_t last_probe;
+	/* events held while the handler is unreachable, oldest first */
+	char held[VFSX_HOLD_MAX][VFSX_MSG_OUT_SIZE];
+	unsigned int held_head;
+	unsigned int held_count;
+	struct vfsx_link_stats stats;
+};
+
+static struct vfsx_link vfsx_link = { .sd = -1 };
+
+static uint64_t vfsx_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void vfsx_link_connect(struct vfsx_link *link)
+{
+	struct sockaddr_un sa;
+	int ret;
+
+	link->sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (link->sd != -1) {
+		strncpy(sa.sun_path, VFSX_SOCKET_FILE, strlen(VFSX_SOCKET_FILE) + 1);
+		sa.sun_family = AF_UNIX;
+		ret = connect(link->sd, (struct sockaddr *) &sa, sizeof(sa));
+		if (ret != -1) {
+			syslog(LOG_NOTICE, "vfsx_write_socket connect succeeded");
+			link->connected = 1;
+		}
+		else {
+			syslog(LOG_NOTICE, "vfsx_write_socket connect failed");
+			close(link->sd);
+			link->sd = -1;
+		}
+	}
+	else {
+		syslog(LOG_NOTICE, "vfsx_write_socket open failed");
+	}
+}
+
+static void vfsx_link_close(struct vfsx_link *link)
+{
+	close(link->sd);
+	link->sd = -1;
+	link->connected = 0;
+	link->pending_count = 0;
+	link->in_len = 0;
+}
+
+static void vfsx_link_reset_window(struct vfsx_link *link)
+{
+	link->window_pos = 0;
+	link->window_count = 0;
+	link->over_slo = 0;
+	link->over_half = 0;
+}
+
+static void vfsx_link_set_level(struct vfsx_link *link, enum vfsx_level level, uint32_t latency)
+{
+	syslog(LOG_NOTICE, "vfsx handler latency %u usec, switching from %s to %s "
+	       "(degraded %llu, recovered %llu, sampled out %llu, bypassed %llu, dropped %llu, timeouts %llu)",
+	       latency, vfsx_level_names[link->level], vfsx_level_names[level],
+	       (unsigned long long)link->stats.degraded, (unsigned long long)link->stats.recovered,
+	       (unsigned long long)link->stats.sampled_out, (unsigned long long)link->stats.bypassed,
+	       (unsigned long long)link->stats.dropped, (unsigned long long)link->stats.timeouts);
+	link->level = level;
+	vfsx_link_reset_window(link);
+}
+
+/*
+ * Adds a round trip sample.  The percentile is over the SLO once more than
+ * (100 - percentile)% of a full window is, so a breach is acted on as soon as
+ * it is certain while recovery waits for a full window under half the SLO.
+ */
+static void vfsx_link_sample(struct vfsx_link *link, const struct vfsx_config *config, uint64_t usec)
+{
+	uint32_t latency = usec > UINT32_MAX ? UINT32_MAX : (uint32_t)usec;
+	unsigned int allowed = VFSX_LATENCY_WINDOW * (100 - config->slo_percentile) / 100;
+	uint32_t old;
+
+	if (link->window_count == VFSX_LATENCY_WINDOW) {
+		old = link->window[link->window_pos];
+		link->over_slo -= (old > config->slo_usec);
+		link->over_half -= (old > config->slo_usec / 2);
+	}
+	else {
+		link->window_count++;
+	}
+	link->window[link->window_pos] = latency;
+	link->window_pos = (link->window_pos + 1) % VFSX_LATENCY_WINDOW;
+	link->over_slo += (latency > config->slo_usec);
+	link->over_half += (latency > config->slo_usec / 2);
+
+	if (link->over_slo > allowed) {
+		if (link->level < VFSX_LEVEL_BYPASS) {
+			link->stats.degraded++;
+			vfsx_link_set_level(link, link->level + 1, latency);
+		}
+	}
+	else if (link->window_count == VFSX_LATENCY_WINDOW && link->over_half <= allowed) {
+		if (link->level > VFSX_LEVEL_SYNC) {
+			link->stats.recovered++;
+			vfsx_link_set_level(link, link->level - 1, latency);
+		}
+	}
+}
+
+/*
+ * A reply read now arrived after the socket was last seen empty, so only
+ * bounds of its latency are known.  It is sampled when both bounds fall on
+ * the same side of the SLO and of half of it.  A reply collected after an
+ * idle gap says nothing about the handler and is left out.
+ */
+static void vfsx_link_sample_reply(struct vfsx_link *link, const struct vfsx_config *config, uint64_t sent)
+{
+	uint64_t upper = vfsx_now_usec() - sent;
+	uint64_t lower = link->checked > sent ? link->checked - sent : 0;
+
+	if ((lower > config->slo_usec) == (upper > config->slo_usec)
+	    && (lower > config->slo_usec / 2) == (upper > config->slo_usec / 2)) {
+		vfsx_link_sample(link, config, upper);
+	}
+}
+
+/* The oldest reply is still missing, which only bounds its latency from below */
+static void vfsx_link_sample_missing(struct vfsx_link *link, const struct vfsx_config *config)
+{
+	uint64_t waited;
+
+	if (link->pending_count == 0) {
+		return;
+	}
+	waited = vfsx_now_usec() - link->pending[link->pending_head];
+	if (waited > config->slo_usec) {
+		vfsx_link_sample(link, config, waited);
+	}
+}
+
+/*
+ * Reads the replies that have arrived.  With a deadline it waits until every
+ * pending message is answered or the deadline passes.  Returns the status of
+ * the last reply read; hints are taken only from the reply to the most recent
+ * message.
+ */
+static int vfsx_link_drain(struct vfsx_link *link, const struct vfsx_config *config, uint64_t deadline,
+			   struct vfsx_hints *hints)
+{
+	int result = VFSX_SUCCESS_TRANSPARENT;
+	struct pollfd pfd;
+	uint64_t now;
+	size_t want;
+	ssize_t ret;
+
+	while (link->connected && link->pending_count > 0) {
+		want = link->in_len < VFSX_MSG_IN_SIZE ? VFSX_MSG_IN_SIZE : vfsx_reply_size(link->in);
+		ret = recv(link->sd, link->in + link->in_len, want - link->in_len, MSG_DONTWAIT);
+		if (ret > 0) {
+			link->in_len += ret;
+			if (link->in_len == VFSX_MSG_IN_SIZE) {
+				want = vfsx_reply_size(link->in);
+			}
+			if (link->in_len == want) {
+				vfsx_link_sample_reply(link, config, link->pending[link->pending_head]);
+				link->pending_head = (link->pending_head + 1) % VFSX_PENDING_MAX;
+				link->pending_count--;
+				// Only the last reply answers the caller's message, earlier
+				// ones are late and their hints were meant for other files.
+				result = vfsx_reply_status(link->in, link->in_len,
+							   link->pending_count == 0 ? hints : NULL);
+				link->in_len = 0;
+			}
+			continue;
+		}
+		if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			syslog(LOG_NOTICE, "vfsx_write_socket read failed");
+			vfsx_link_close(link);
+			break;
+		}
+		link->checked = vfsx_now_usec();
+		if (deadline == 0) {
+			break;
+		}
+		now = vfsx_now_usec();
+		if (now >= deadline) {
+			link->stats.timeouts++;
+			vfsx_link_sample_missing(link, config);
+			result = VFSX_SUCCESS_TRANSPARENT;
+			break;
+		}
+		pfd.fd = link->sd;
+		pfd.events = POLLIN;
+		// poll() returns as the reply comes in, which times it
+		if (poll(&pfd, 1, (deadline - now + 999) / 1000) > 0) {
+			link->checked = vfsx_now_usec();
+		}
+	}
+	return result;
+}
+
+/* Queues one message without blocking on a stalled handler */
+static bool vfsx_link_send(struct vfsx_link *link, const struct vfsx_config *config, const char *str)
+{
+	char out[VFSX_MSG_OUT_SIZE];
+	struct pollfd pfd;
+	uint64_t now = vfsx_now_usec();
+	uint64_t deadline = now + config->slo_timeout_usec;
+	size_t done = 0;
+	ssize_t ret;
+
+	if (link->pending_count == VFSX_PENDING_MAX) {
+		link->stats.dropped++;
+		vfsx_link_sample_missing(link, config);
+		return false;
+	}
+
+	memset(out, 0, VFSX_MSG_OUT_SIZE);
+	strncpy(out, str, VFSX_MSG_OUT_SIZE - 1);
+	while (done < VFSX_MSG_OUT_SIZE) {
+		ret = send(link->sd, out + done, VFSX_MSG_OUT_SIZE - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret > 0) {
+			done += ret;
+			continue;
+		}
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			if (done == 0) {
+				/* nothing went out, the stream is still in sync */
+				link->stats.dropped++;
+				vfsx_link_sample_missing(link, config);
+				return false;
+			}
+			now = vfsx_now_usec();
+			if (now < deadline) {
+				pfd.fd = link->sd;
+				pfd.events = POLLOUT;
+				poll(&pfd, 1, (deadline - now + 999) / 1000);
+				continue;
+			}
+		}
+		/* a message cut short can't be completed, start over */
+		syslog(LOG_NOTICE, "vfsx_write_socket write failed");
+		vfsx_link_close(link);
+		return false;
+	}
+
+	link->pending[(link->pending_head + link->pending_count) % VFSX_PENDING_MAX] = vfsx_now_usec();
+	link->pending_count++;
+	return true;
+}
+
+/* Returns false when the event could not be written because the link failed */
+static bool vfsx_link_adaptive(struct vfsx_link *link, const struct vfsx_config *config,
+			       const char *str, int control, struct vfsx_hints *hints, int *result)
+{
+	uint64_t now = vfsx_now_usec();
+
+	*result = VFSX_SUCCESS_TRANSPARENT;
+	vfsx_link_drain(link, config, 0, NULL);
+
+	/* connect and disconnect always go out so sessions stay balanced */
+	if (!control && link->level == VFSX_LEVEL_SAMPLE
+	    && ++link->sample_count % config->sample_rate != 0) {
+		link->stats.sampled_out++;
+		return true;
+	}
+	if (!control && link->level == VFSX_LEVEL_BYPASS) {
+		if (now - link->last_probe < VFSX_PROBE_INTERVAL_USEC) {
+			link->stats.bypassed++;
+			return true;
+		}
+		link->last_probe = now;
+	}
+
+	if (!link->connected) {
+		return false;
+	}
+	if (!vfsx_link_send(link, config, str)) {
+		/* still connected means the event was dropped on purpose */
+		return link->connected;
+	}
+	if (link->level == VFSX_LEVEL_SYNC) {
+		*result = vfsx_link_drain(link, config, vfsx_now_usec() + config->slo_timeout_usec, hints);
+	}
+	else if (link->pending_count == 1) {
+		// Nothing else is in flight, so the next drain may come much later
+		// than the reply.  Waiting up to the SLO is enough to classify it.
+		vfsx_link_drain(link, config, vfsx_now_usec() + config->slo_usec + 1, NULL);
+	}
+	return true;
+}
+
+/* Returns false when the event could not be written because the link failed */
+static bool vfsx_link_roundtrip(struct vfsx_link *link, const char *str, struct vfsx_hints *hints, int *result)
+{
+	char out[VFSX_MSG_OUT_SIZE];
+	char in[VFSX_MSG_IN_SIZE + VFSX_HINTS_MAX];
+	size_t len, want;
+	ssize_t ret;
+
+	// Assume the operation is success
+	*result = VFSX_SUCCESS_TRANSPARENT;
+
+	memset(out, 0, VFSX_MSG_OUT_SIZE);
+	strncpy(out, str, VFSX_MSG_OUT_SIZE - 1);
+	ret = send(link->sd, out, VFSX_MSG_OUT_SIZE, MSG_NOSIGNAL);
+	if (ret == VFSX_MSG_OUT_SIZE) {
+		memset(in, 0, sizeof(in));
+		ret = read(link->sd, in, VFSX_MSG_IN_SIZE);
+		len = ret > 0 ? ret : 0;
+		// A reply with hints continues past the status frame.
+		if (len == VFSX_MSG_IN_SIZE) {
+			want = vfsx_reply_size(in);
+			while (ret > 0 && len < want) {
+				ret = read(link->sd, in + len, want - len);
+				len += ret > 0 ? ret : 0;
+			}
+		}
+		if (ret > 0) {
+			*result = vfsx_reply_status(in, len, hints);
+		}
+		else {
+			syslog(LOG_NOTICE, "vfsx_write_socket read failed");
+			vfsx_link_close(link);
+		}
+		return true;
+	}
+	syslog(LOG_NOTICE, "vfsx_write_socket write failed");
+	vfsx_link_close(link);
+	return false;
+}
+
+/* Holds an event that could not be written, dropping the oldest when full */
+static void vfsx_link_hold(struct vfsx_link *link, const struct vfsx_config *config, const char *str)
+{
+	unsigned int max = MIN(config->hold_max, VFSX_HOLD_MAX);
+	char *slot;
+
+	while (link->held_count > 0 && link->held_count >= max) {
+		link->held_head = (link->held_head + 1) % VFSX_HOLD_MAX;
+		link->held_count--;
+		link->stats.dropped++;
+	}
+	if (max == 0) {
+		link->stats.dropped++;
+		return;
+	}
+	slot = link->held[(link->held_head + link->held_count) % VFSX_HOLD_MAX];
+	strncpy(slot, str, VFSX_MSG_OUT_SIZE - 1);
+	slot[VFSX_MSG_OUT_SIZE - 1] = '\0';
+	link->held_count++;
+}
+
+/* Sends the held events, oldest first, on a link that just came back */
+static void vfsx_link_release(struct vfsx_link *link, const struct vfsx_config *config)
+{
+	int result;
+	bool sent;
+
+	while (link->connected && link->held_count > 0) {
+		if (config->slo_usec == 0) {
+			sent = vfsx_link_roundtrip(link, link->held[link->held_head], NULL, &result);
+		}
+		else {
+			sent = vfsx_link_send(link, config, link->held[link->held_head]) || link->connected;
+		}
+		if (!sent) {
+			break;
+		}
+		link->held_head = (link->held_head + 1) % VFSX_HOLD_MAX;
+		link->held_count--;
+	}
+}
+
+static int vfsx_write_socket(const struct vfsx_config *config, const char *str, int control, int close_socket,
+			     struct vfsx_hints *hints)
+{
+	struct vfsx_link *link = &vfsx_link;
+	int result = VFSX_SUCCESS_TRANSPARENT;
+	bool sent = false;
+	int attempt;
+
+	// A write that fails on an established link gets one reconnect right
+	// away, which finds the successor of a restarting handler.
+	for (attempt = 0; attempt < 2 && !sent; attempt++) {
+		if (!link->connected) {
+			vfsx_link_connect(link);
+			if (!link->connected) {
+				break;
+			}
+			vfsx_link_release(link, config);
+			if (!link->connected) {
+				continue;
+			}
+		}
+		if (config->slo_usec == 0) {
+			sent = vfsx_link_roundtrip(link, str, hints, &result);
+		}
+		else {
+			sent = vfsx_link_adaptive(link, config, str, control, hints, &result);
+		}
+	}
+	if (!sent) {
+		vfsx_link_hold(link, config, str);
+	}
+
+	if (close_socket && link->connected) {
+		syslog(LOG_NOTICE, "vfsx_write_socket closing normally");
+		vfsx_link_close(link);
+	}
+
+	if (result == VFSX_FAIL_ERROR) {
+		// TODO: Correct error code?
+		errno = EIO;
+	}
+	else if (result == VFSX_FAIL_AUTHORIZATION) {
+		errno = EPERM;
+	}
+	return result;
+}
+
+/*
+ * Trace capture.  A trace file holds the 8 byte magic followed by records of
+ * a little-endian header (usec timestamp, smbd pid, message length) and the
+ * message text as it was handed to the socket.  Several smbd processes may
+ * append to the same file, so every record goes out in a single write and
+ * readers skip a magic found at a record boundary.
+ */
+
+/* Opens an append-only log file, writing its magic when the file is new */
+static int vfsx_log_open(const char *path, const char *magic)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0600);
+	if (fd != -1) {
+		write(fd, magic, strlen(magic));
+		return fd;
+	}
+	if (errno == EEXIST) {
+		fd = open(path, O_WRONLY | O_APPEND);
+	}
+	if (fd == -1) {
+		syslog(LOG_NOTICE, "vfsx_log_open can't open %s", path);
+	}
+	return fd;
+}
+
+static void vfsx_trace_write(int fd, const char *str, int count)
+{
+	char rec[VFSX_TRACE_HDR_SIZE + VFSX_MSG_OUT_SIZE];
+	struct timespec ts;
+	uint64_t usec;
+
+	if (count >= VFSX_MSG_OUT_SIZE) {
+		count = VFSX_MSG_OUT_SIZE - 1;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	usec = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	SBVAL(rec, 0, usec);
+	SIVAL(rec, 8, (uint32_t)getpid());
+	SIVAL(rec, 12, (uint32_t)count);
+	memcpy(rec + VFSX_TRACE_HDR_SIZE, str, count);
+	if (write(fd, rec, VFSX_TRACE_HDR_SIZE + count) == -1) {
+		syslog(LOG_NOTICE, "vfsx_trace_write write failed");
+	}
+}
+
+/*
+ * Path filter.  The vfsx:include and vfsx:exclude patterns of a share are
+ * compiled at connect time into a trie over their leading literal path
+ * components.  Whatever is left of a pattern hangs off the trie node it
+ * reaches and is classified so the common shapes ("*.tmp", "~$*", a plain
+ * name) are matched with a single compare instead of the glob matcher.
+ * Patterns without a '/' apply to every component at any depth, as if
+ * written "**" "/pattern": a directory they match takes its subtree along.
+ * Matching ignores case, like the clients do.
+ */
+
+enum vfsx_match_kind {
+	VFSX_MATCH_ALL,		/* "", "**": the node's whole subtree */
+	VFSX_MATCH_EXACT,	/* "name" */
+	VFSX_MATCH_SUFFIX,	/* "*.ext" */
+	VFSX_MATCH_PREFIX,	/* "~$*" */
+	VFSX_MATCH_GLOB		/* anything else, '*', '?' and '**' */
+};
+
+struct vfsx_pattern {
+	struct vfsx_pattern *next;
+	enum vfsx_match_kind kind;
+	bool deep;		/* match any component at any depth */
+	const char *text;
+	size_t len;
+};
+
+struct vfsx_trie_node {
+	struct vfsx_trie_node *children;
+	struct vfsx_trie_node *sibling;
+	const char *name;
+	size_t len;
+	struct vfsx_pattern *patterns;
+};
+
+static bool vfsx_has_wildcard(const char *str, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (str[i] == '*' || str[i] == '?') {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool vfsx_glob_match(const char *pat, const char *str)
+{
+	while (*pat != '\0') {
+		if (pat[0] == '*' && pat[1] == '*') {
+			pat += 2;
+			/* "**" followed by "/" also matches no directory at all */
+			if (*pat == '/' && vfsx_glob_match(pat + 1, str)) {
+				return true;
+			}
+			for (;; str++) {
+				if (vfsx_glob_match(pat, str)) {
+					return true;
+				}
+				if (*str == '\0') {
+					return false;
+				}
+			}
+		}
+		if (*pat == '*') {
+			pat++;
+			for (;; str++) {
+				if (vfsx_glob_match(pat, str)) {
+					return true;
+				}
+				if (*str == '\0' || *str == '/') {
+					return false;
+				}
+			}
+		}
+		if (*str == '\0') {
+			return false;
+		}
+		if (*pat == '?') {
+			if (*str == '/') {
+				return false;
+			}
+		}
+		else if (tolower((unsigned char)*pat) != tolower((unsigned char)*str)) {
+			return false;
+		}
+		pat++;
+		str++;
+	}
+	return *str == '\0';
+}
+
+/* Matches the first len bytes of subject, which hold no '/' unless p is a glob */
+static bool vfsx_name_match(const struct vfsx_pattern *p, const char *subject, size_t len)
+{
+	char name[PATH_MAX];
+
+	switch (p->kind) {
+	case VFSX_MATCH_EXACT:
+		return len == p->len && strncasecmp(subject, p->text, len) == 0;
+	case VFSX_MATCH_SUFFIX:
+		return len >= p->len && strncasecmp(subject + len - p->len, p->text, p->len) == 0;
+	case VFSX_MATCH_PREFIX:
+		return len >= p->len && strncasecmp(subject, p->text, p->len) == 0;
+	default:
+		if (subject[len] == '\0') {
+			return vfsx_glob_match(p->text, subject);
+		}
+		if (len >= sizeof(name)) {
+			return false;
+		}
+		memcpy(name, subject, len);
+		name[len] = '\0';
+		return vfsx_glob_match(p->text, name);
+	}
+}
+
+static bool vfsx_pattern_match(const struct vfsx_pattern *p, const char *subject)
+{
+	const char *end;
+
+	if (p->kind == VFSX_MATCH_ALL) {
+		return true;
+	}
+	if (!p->deep) {
+		/* the plain kinds never span a directory */
+		if (p->kind != VFSX_MATCH_GLOB && strchr(subject, '/') != NULL) {
+			return false;
+		}
+		return vfsx_name_match(p, subject, strlen(subject));
+	}
+
+	/* any component, so a matching directory covers its whole subtree */
+	for (;;) {
+		end = strchr(subject, '/');
+		if (vfsx_name_match(p, subject, end != NULL ? (size_t)(end - subject) : strlen(subject))) {
+			return true;
+		}
+		if (end == NULL) {
+			return false;
+		}
+		subject = end + 1;
+	}
+}
+
+static struct vfsx_trie_node *vfsx_trie_find(const struct vfsx_trie_node *node,
+					     const char *name, size_t len)
+{
+	struct vfsx_trie_node *child;
+
+	for (child = node->children; child != NULL; child = child->sibling) {
+		if (child->len == len && strncasecmp(child->name, name, len) == 0) {
+			return child;
+		}
+	}
+	return NULL;
+}
+
+static struct vfsx_trie_node *vfsx_trie_child(TALLOC_CTX *mem_ctx,
+					      struct vfsx_trie_node *node,
+					      const char *name, size_t len)
+{
+	struct vfsx_trie_node *child;
+
+	child = vfsx_trie_find(node, name, len);
+	if (child != NULL) {
+		return child;
+	}
+	child = talloc_zero(mem_ctx, struct vfsx_trie_node);
+	if (child == NULL) {
+		return NULL;
+	}
+	child->name = talloc_strndup(child, name, len);
+	child->len = len;
+	child->sibling = node->children;
+	node->children = child;
+	return child;
+}
+
+static bool vfsx_trie_add(TALLOC_CTX *mem_ctx, struct vfsx_trie_node *root, const char *pattern)
+{
+	struct vfsx_trie_node *node = root;
+	struct vfsx_pattern *p;
+	const char *end;
+	size_t len;
+
+	p = talloc_zero(mem_ctx, struct vfsx_pattern);
+	if (p == NULL) {
+		return false;
+	}
+	while (*pattern == '/') {
+		pattern++;
+	}
+	p->deep = (strchr(pattern, '/') == NULL && strcmp(pattern, "**") != 0);
+
+	/* walk the literal leading components into the trie */
+	while (!p->deep && *pattern != '\0') {
+		end = strchr(pattern, '/');
+		len = end != NULL ? (size_t)(end - pattern) : strlen(pattern);
+		if (vfsx_has_wildcard(pattern, len)) {
+			break;
+		}
+		node = vfsx_trie_child(mem_ctx, node, pattern, len);
+		if (node == NULL) {
+			return false;
+		}
+		pattern += len;
+		while (*pattern == '/') {
+			pattern++;
+		}
+	}
+
+	/* "**" "/" followed by a single component is a deep match of that component */
+	if (strncmp(pattern, "**/", 3) == 0 && strchr(pattern + 3, '/') == NULL
+	    && strstr(pattern + 3, "**") == NULL) {
+		pattern += 3;
+		p->deep = true;
+	}
+
+	len = strlen(pattern);
+	if (len == 0 || strcmp(pattern, "**") == 0) {
+		p->kind = VFSX_MATCH_ALL;
+	}
+	else if (!vfsx_has_wildcard(pattern, len)) {
+		p->kind = VFSX_MATCH_EXACT;
+	}
+	else if (pattern[0] == '*' && !vfsx_has_wildcard(pattern + 1, len - 1)
+		 && strchr(pattern, '/') == NULL) {
+		p->kind = VFSX_MATCH_SUFFIX;
+		pattern++;
+	}
+	else if (pattern[len - 1] == '*' && !vfsx_has_wildcard(pattern, len - 1)
+		 && strchr(pattern, '/') == NULL) {
+		p->kind = VFSX_MATCH_PREFIX;
+		len--;
+	}
+	else {
+		p->kind = VFSX_MATCH_GLOB;
+	}
+	p->text = talloc_strndup(p, pattern, p->kind == VFSX_MATCH_PREFIX ? len : strlen(pattern));
+	if (p->text == NULL) {
+		return false;
+	}
+	p->len = strlen(p->text);
+	p->next = node->patterns;
+	node->patterns = p;
+	return true;
+}
+
+static struct vfsx_trie_node *vfsx_trie_compile(TALLOC_CTX *mem_ctx, const char **patterns)
+{
+	struct vfsx_trie_node *root;
+	int i;
+
+	if (patterns == NULL || patterns[0] == NULL) {
+		return NULL;
+	}
+	root = talloc_zero(mem_ctx, struct vfsx_trie_node);
+	if (root == NULL) {
+		return NULL;
+	}
+	for (i = 0; patterns[i] != NULL; i++) {
+		if (!vfsx_trie_add(root, root, patterns[i])) {
+			syslog(LOG_NOTICE, "vfsx_trie_compile can't add pattern %s", patterns[i]);
+		}
+	}
+	return root;
+}
+
+static bool vfsx_trie_match(const struct vfsx_trie_node *node, const char *path)
+{
+	const struct vfsx_pattern *p;
+	const char *end;
+	size_t len;
+
+	while (node != NULL) {
+		for (p = node->patterns; p != NULL; p = p->next) {
+			if (vfsx_pattern_match(p, path)) {
+				return true;
+			}
+		}
+		if (*path == '\0') {
+			break;
+		}
+		end = strchr(path, '/');
+		len = end != NULL ? (size_t)(end - path) : strlen(path);
+		node = vfsx_trie_find(node, path, len);
+		path += len;
+		while (*path == '/') {
+			path++;
+		}
+	}
+	return false;
+}
+
+/* Returns path relative to the share root, without a leading "/" or "./" */
+static const char *vfsx_share_path(const struct vfsx_config *config, const char *path)
+{
+	size_t len = strlen(config->connectpath);
+
+	if (strncmp(path, config->connectpath, len) == 0 && (path[len] == '/' || path[len] == '\0')) {
+		path += len;
+	}
+	while (*path == '/' || (path[0] == '.' && (path[1] == '/' || path[1] == '\0'))) {
+		path++;
+	}
+	return path;
+}
+
+/* Returns whether events for path (relative to the share) go to the handler */
+static bool vfsx_wanted(vfs_handle_struct *handle, const char *path)
+{
+	struct vfsx_config *config;
+
+	SMB_VFS_HANDLE_GET_DATA(handle, config, struct vfsx_config, return true);
+	if (config->include == NULL && config->exclude == NULL) {
+		return true;
+	}
+
+	path = vfsx_share_path(config, path);
+	if (config->include != NULL && !vfsx_trie_match(config->include, path)) {
+		return false;
+	}
+	return config->exclude == NULL || !vfsx_trie_match(config->exclude, path);
+}
+
+/*
+ * Change journal.  With vfsx:journal file set, the module records which
+ * paths of the share changed, independent of the handler.  A changed path
+ * stays in an in-memory set while its record is pending, so repeated writes
+ * to a file yield a single record.  Deletes and renames take their paths
+ * out of the set, so a file changed again afterwards is recorded again.
+ * Records are buffered and appended with a single write when the buffer
+ * fills, vfsx:journal flush usec after the first pending change, and at
+ * disconnect.  The journal file holds the 8 byte magic followed by records
+ * of a little-endian header (usec timestamp, payload length, change type)
+ * and the NUL terminated absolute path, followed by the new path for a
+ * rename.  A reader's cursor is the byte offset past the last record read.
+ */
+
+enum vfsx_change {
+	VFSX_CHANGE_DATA = 'M',		/* written, truncated, allocated or synced */
+	VFSX_CHANGE_META = 'A',		/* timestamps or extended attributes */
+	VFSX_CHANGE_CREATE = 'C',
+	VFSX_CHANGE_DELETE = 'D',
+	VFSX_CHANGE_RENAME = 'R'
+};
+
+struct vfsx_dirty {
+	struct vfsx_dirty *next;
+	uint32_t hash;
+	bool data;
+	bool meta;
+	char *path;
+};
+
+struct vfsx_journal {
+	int fd;
+	uint32_t flush_usec;
+	struct tevent_context *ev;
+	struct tevent_timer *timer;	/* the pending flush */
+	TALLOC_CTX *marks;		/* owns the entries of dirty until the flush */
+	struct vfsx_dirty *dirty[VFSX_JOURNAL_BUCKETS];
+	size_t len;
+	char buf[VFSX_JOURNAL_BUF_SIZE];
+};
+
+static uint32_t vfsx_path_hash(const char *path)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*path != '\0') {
+		hash = (hash ^ (unsigned char)*path++) * 16777619u;
+	}
+	return hash;
+}
+
+static struct vfsx_journal *vfsx_journal_open(TALLOC_CTX *mem_ctx, connection_struct *conn,
+					      const char *path, uint32_t flush_usec)
+{
+	struct vfsx_journal *journal;
+
+	journal = talloc_zero(mem_ctx, struct vfsx_journal);
+	if (journal == NULL) {
+		return NULL;
+	}
+	journal->fd = vfsx_log_open(path, VFSX_JOURNAL_MAGIC);
+	if (journal->fd == -1) {
+		TALLOC_FREE(journal);
+		return NULL;
+	}
+	journal->flush_usec = flush_usec;
+	journal->ev = conn->sconn->ev_ctx;
+	return journal;
+}
+
+static void vfsx_journal_flush(struct vfsx_journal *journal)
+{
+	TALLOC_FREE(journal->timer);
+	if (journal->len > 0 && write(journal->fd, journal->buf, journal->len) == -1) {
+		syslog(LOG_NOTICE, "vfsx_journal_flush write failed");
+	}
+	journal->len = 0;
+	TALLOC_FREE(journal->marks);
+	memset(journal->dirty, 0, sizeof(journal->dirty));
+}
+
+static void vfsx_journal_timer(struct tevent_context *ev, struct tevent_timer *te,
+			       struct timeval now, void *private_data)
+{
+	struct vfsx_journal *journal = (struct vfsx_journal *)private_data;
+
+	// tevent frees the timer once it has fired
+	journal->timer = NULL;
+	vfsx_journal_flush(journal);
+}
+
+static void vfsx_journal_append(struct vfsx_journal *journal, enum vfsx_change change,
+				const char *path, const char *new_path)
+{
+	size_t path_len = strlen(path) + 1;
+	size_t new_len = new_path != NULL ? strlen(new_path) + 1 : 0;
+	size_t size = VFSX_JOURNAL_HDR_SIZE + path_len + new_len;
+	struct timespec ts;
+	char *rec;
+
+	if (size > sizeof(journal->buf)) {
+		return;
+	}
+	if (journal->len + size > sizeof(journal->buf)) {
+		vfsx_journal_flush(journal);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec = journal->buf + journal->len;
+	SBVAL(rec, 0, (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+	SIVAL(rec, 8, (uint32_t)(path_len + new_len));
+	SIVAL(rec, 12, 0);
+	SCVAL(rec, 12, change);
+	memcpy(rec + VFSX_JOURNAL_HDR_SIZE, path, path_len);
+	if (new_path != NULL) {
+		memcpy(rec + VFSX_JOURNAL_HDR_SIZE + path_len, new_path, new_len);
+	}
+	journal->len += size;
+
+	if (journal->flush_usec == 0) {
+		vfsx_journal_flush(journal);
+	}
+	else if (journal->timer == NULL) {
+		journal->timer = tevent_add_timer(journal->ev, journal,
+						  timeval_current_ofs_usec(journal->flush_usec),
+						  vfsx_journal_timer, journal);
+	}
+}
+
+static struct vfsx_dirty **vfsx_journal_find(struct vfsx_journal *journal, const char *path, uint32_t hash)
 {
-	int fd;
+	struct vfsx_dirty **entry = &journal->dirty[hash % VFSX_JOURNAL_BUCKETS];
 
-	fd = open(VFSX_LOG_FILE, O_RDWR | O_APPEND);
-	if (fd != -1) {
-		write(fd, str, strlen(str));
-		write(fd, "\n", 1);
-		close(fd);
+	while (*entry != NULL && ((*entry)->hash != hash || strcmp((*entry)->path, path) != 0)) {
+		entry = &(*entry)->next;
 	}
-	else {
-		syslog(LOG_NOTICE, "vfsx_write_file can't write");
+	return entry;
+}
+
+/* Takes path out of the dirty set.  The entry is freed at the next flush. */
+static void vfsx_journal_forget(struct vfsx_journal *journal, const char *path)
+{
+	struct vfsx_dirty **entry = vfsx_journal_find(journal, path, vfsx_path_hash(path));
+
+	if (*entry != NULL) {
+		*entry = (*entry)->next;
 	}
 }
 
-static int vfsx_write_socket(const char *str, int close_socket)
+/* Records a change of path, renamed to new_path, if the share keeps a journal */
+static void vfsx_journal_mark(vfs_handle_struct *handle, enum vfsx_change change,
+			      const char *path, const char *new_path)
 {
-	static int connected = 0;
-	static int sd = -1;
-	static int count = 0;
-	char out[VFSX_MSG_OUT_SIZE];
-	char in[VFSX_MSG_IN_SIZE];
-	int ret;
-	struct sockaddr_un sa;
-	// Assume the operation is success
-	int result = VFSX_SUCCESS_TRANSPARENT;
+	struct vfsx_config *config;
+	struct vfsx_journal *journal;
+	struct vfsx_dirty **entry, *dirty;
+	char full[PATH_MAX], new_full[PATH_MAX];
+	const char *rel;
+	uint32_t hash;
+
+	SMB_VFS_HANDLE_GET_DATA(handle, config, struct vfsx_config, return);
+	journal = config->journal;
+	if (journal == NULL) {
+		return;
+	}
+	if (!vfsx_wanted(handle, path) && (new_path == NULL || !vfsx_wanted(handle, new_path))) {
+		return;
+	}
 
-	if (!connected) {
-		sd = socket(AF_UNIX, SOCK_STREAM, 0);
-		if (sd != -1) {
-			strncpy(sa.sun_path, VFSX_SOCKET_FILE, strlen(VFSX_SOCKET_FILE) + 1);
-			sa.sun_family = AF_UNIX;
-			ret = connect(sd, (struct sockaddr *) &sa, sizeof(sa));
-			if (ret != -1) {
-				syslog(LOG_NOTICE, "vfsx_write_socket connect succeeded");
-				connected = 1;
-			}
-			else {
-				syslog(LOG_NOTICE, "vfsx_write_socket connect failed");
-				close(sd);
-			}
-		}
-		else {
-			syslog(LOG_NOTICE, "vfsx_write_socket open failed");
+	rel = vfsx_share_path(config, path);
+	snprintf(full, sizeof(full), "%s%s%s", config->connectpath, *rel != '\0' ? "/" : "", rel);
+	hash = vfsx_path_hash(full);
+	entry = vfsx_journal_find(journal, full, hash);
+
+	switch (change) {
+	case VFSX_CHANGE_DATA:
+	case VFSX_CHANGE_META:
+		if (*entry != NULL && (change == VFSX_CHANGE_DATA ? (*entry)->data : (*entry)->meta)) {
+			return;
 		}
+		break;
+	case VFSX_CHANGE_CREATE:
+		vfsx_journal_forget(journal, full);
+		break;
+	case VFSX_CHANGE_DELETE:
+		vfsx_journal_forget(journal, full);
+		vfsx_journal_append(journal, change, full, NULL);
+		return;
+	case VFSX_CHANGE_RENAME:
+		rel = vfsx_share_path(config, new_path);
+		snprintf(new_full, sizeof(new_full), "%s%s%s", config->connectpath, *rel != '\0' ? "/" : "", rel);
+		vfsx_journal_forget(journal, full);
+		vfsx_journal_forget(journal, new_full);
+		vfsx_journal_append(journal, change, full, new_full);
+		return;
 	}
 
-	if (connected) {
-		memset(out, 0, VFSX_MSG_OUT_SIZE);
-		strncpy(out, str, strlen(str) + 1);
-		ret = write(sd, out, VFSX_MSG_OUT_SIZE);
-		if (ret != -1) {
-			memset(in, 0, VFSX_MSG_IN_SIZE);
-			ret = read(sd, in, VFSX_MSG_IN_SIZE);
-			if (ret != -1) {
-				result = atoi(in);
-				if (close_socket) {
-					syslog(LOG_NOTICE, "vfsx_write_socket closing normally");
-					close(sd);
-					connected = 0;
-				}
-			}
-			else {
-				syslog(LOG_NOTICE, "vfsx_write_socket read failed");
-				close(sd);
-				connected = 0;
-			}
+	vfsx_journal_append(journal, change, full, NULL);
+	// Dedup only while the record is pending, the append may have flushed.
+	if (journal->len == 0) {
+		return;
+	}
+	entry = vfsx_journal_find(journal, full, hash);
+	if (*entry == NULL) {
+		if (journal->marks == NULL) {
+			journal->marks = talloc_new(journal);
 		}
-		else {
-			syslog(LOG_NOTICE, "vfsx_write_socket write failed");
-			close(sd);
-			connected = 0;
+		dirty = journal->marks != NULL ? talloc_zero(journal->marks, struct vfsx_dirty) : NULL;
+		if (dirty == NULL) {
+			return;
 		}
+		dirty->path = talloc_strdup(dirty, full);
+		if (dirty->path == NULL) {
+			TALLOC_FREE(dirty);
+			return;
+		}
+		dirty->hash = hash;
+		*entry = dirty;
+	}
+	// A new file counts as written: the create record covers what follows.
+	if (change != VFSX_CHANGE_META) {
+		(*entry)->data = true;
 	}
+	if (change != VFSX_CHANGE_DATA) {
+		(*entry)->meta = true;
+	}
+}
 
-	if (result == VFSX_FAIL_ERROR) {
-		// TODO: Correct error code?
-		errno = EIO;
+/*
+ * The stable key of a file, taken from a stat the caller already has.
+ * Returns NULL when the stat is not valid, or when events carry no key
+ * because vfsx:event info is off.
+ */
+static const struct file_id *vfsx_stat_key(vfs_handle_struct *handle, const SMB_STRUCT_STAT *st, struct file_id *id)
+{
+	struct vfsx_config *config;
+
+	SMB_VFS_HANDLE_GET_DATA(handle, config, struct vfsx_config, return NULL);
+	if (!config->event_info || !VALID_STAT(*st)) {
+		return NULL;
 	}
-	else if (result == VFSX_FAIL_AUTHORIZATION) {
-		errno = EPERM;
+	*id = SMB_VFS_NEXT_FILE_ID_CREATE(handle, st);
+	return id;
+}
+
+/*
+ * The key of a file just opened as fd.  A file that was just created has no
+ * stat yet, and fsp->file_id is only filled in once the open returns, so it
+ * may take an fstat().
+ */
+static const struct file_id *vfsx_open_key(vfs_handle_struct *handle, int fd, const SMB_STRUCT_STAT *st,
+					   struct file_id *id)
+{
+	struct vfsx_config *config;
+	SMB_STRUCT_STAT sbuf;
+
+	SMB_VFS_HANDLE_GET_DATA(handle, config, struct vfsx_config, return NULL);
+	if (!config->event_info) {
+		return NULL;
 	}
-	return result;
+	if (VALID_STAT(*st)) {
+		return vfsx_stat_key(handle, st, id);
+	}
+	if (sys_fstat(fd, &sbuf, lp_fake_directory_create_times(SNUM(handle->conn))) != 0) {
+		return NULL;
+	}
+	return vfsx_stat_key(handle, &sbuf, id);
 }
 
-static int vfsx_execute(const char *buf, int count)
+static int vfsx_execute(vfs_handle_struct *handle, const struct file_id *id, const char *buf, int count,
+			struct vfsx_hints *hints)
 {
+	static pid_t seq_pid;
+	static uint64_t seq;
+	struct vfsx_config *config;
+	char msg[VFSX_MSG_OUT_SIZE];
+	char key[40] = "";
+	pid_t pid = getpid();
+	const char *no_args = "";
 	int close_sock = 0;
+	int control = 0;
 
-	// buf = "user:operation:origpath:arg1,arg2,arg3"
+	// buf = "operation:origpath:arg1,arg2,arg3:"
 
-	if (strncmp(buf, "disconnect", 10) == 0) {
-		close_sock = 1;
+	if (count <= 0) {
+		return VFSX_FAIL_ERROR;
 	}
 
-	if (count > 0) {
-		//vfsx_write_file(buf);
-		return vfsx_write_socket(buf, close_sock);
+	if (strncmp(buf, "disconnect:", 11) == 0) {
+		close_sock = 1;
+		control = 1;
+		no_args = ":";
+	}
+	else if (strncmp(buf, "connect:", 8) == 0) {
+		control = 1;
+		no_args = ":";
+	}
+	else if (strncmp(buf, "stats:", 6) == 0 || strncmp(buf, "usage:", 6) == 0) {
+		control = 1;
+	}
+	SMB_VFS_HANDLE_GET_DATA(handle, config, struct vfsx_config, return VFSX_FAIL_ERROR);
+
+	// With vfsx:event info, stamp the event with its sequence number in this
+	// smbd process and the key of its file:
+	// "operation:origpath:arg1,arg2,arg3:seq,pid,key:".  connect and
+	// disconnect get an empty argument field first.  Events dropped later on
+	// show up as gaps in the sequence.
+	if (config->event_info) {
+		if (seq_pid != pid) {
+			seq_pid = pid;
+			seq = 0;
+		}
+		if (id != NULL) {
+			snprintf(key, sizeof(key), "%llx-%llx",
+				 (unsigned long long)id->devid, (unsigned long long)id->inode);
+		}
+		count = snprintf(msg, VFSX_MSG_OUT_SIZE, "%s%s%llu,%d,%s:", buf, no_args,
+				 (unsigned long long)++seq, (int)pid, key);
 	}
 	else {
-		return VFSX_FAIL_ERROR;
+		count = snprintf(msg, VFSX_MSG_OUT_SIZE, "%s", buf);
+	}
+	if (count >= VFSX_MSG_OUT_SIZE) {
+		count = VFSX_MSG_OUT_SIZE - 1;
+	}
+
+	//vfsx_write_file(msg);
+	if (config->trace_fd != -1) {
+		vfsx_trace_write(config->trace_fd, msg, count);
+	}
+	return vfsx_write_socket(config, msg, control, close_sock, hints);
+}
+
+/*
+ * I/O accounting.  With vfsx:usage interval usec set, each smbd process adds
+ * up the bytes and calls of every user of the share in a small table, and
+ * sends one "usage" event per user when the interval ends and at disconnect:
+ * "usage:origpath:uid,usec,bytes read,bytes written,reads,writes,opens,
+ * creates:".  The interval starts with the first call counted, so idle
+ * processes send nothing.  A full table ends the interval early.  Every
+ * path is counted, vfsx:include and vfsx:exclude only filter events.
+ */
+
+struct vfsx_usage {
+	uid_t uid;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t opens;
+	uint64_t creates;
+};
+
+struct vfsx_accounting {
+	vfs_handle_struct *handle;
+	uint32_t interval_usec;
+	uint64_t start;			/* when the current interval began */
+	struct tevent_context *ev;
+	struct tevent_timer *timer;	/* the end of the current interval */
+	unsigned int count;
+	unsigned int last;		/* the user of the last call */
+	struct vfsx_usage users[VFSX_USAGE_USERS];
+};
+
+static struct vfsx_accounting *vfsx_accounting_open(TALLOC_CTX *mem_ctx, vfs_handle_struct *handle,
+						    uint32_t interval_usec)
+{
+	struct vfsx_accounting *acct;
+
+	acct = talloc_zero(mem_ctx, struct vfsx_accounting);
+	if (acct == NULL) {
+		return NULL;
+	}
+	acct->handle = handle;
+	acct->interval_usec = interval_usec;
+	acct->ev = handle->conn->sconn->ev_ctx;
+	return acct;
+}
+
+static void vfsx_usage_send(struct vfsx_accounting *acct)
+{
+	const struct vfsx_usage *u;
+	uint64_t usec = vfsx_now_usec() - acct->start;
+	unsigned int i;
+	int count;
+	char buf[VFSX_MSG_OUT_SIZE];
+
+	TALLOC_FREE(acct->timer);
+	for (i = 0; i < acct->count; i++) {
+		u = &acct->users[i];
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "usage:%s:%u,%llu,%llu,%llu,%llu,%llu,%llu,%llu:",
+				 acct->handle->conn->origpath, (unsigned int)u->uid, (unsigned long long)usec,
+				 (unsigned long long)u->bytes_read, (unsigned long long)u->bytes_written,
+				 (unsigned long long)u->reads, (unsigned long long)u->writes,
+				 (unsigned long long)u->opens, (unsigned long long)u->creates);
+		vfsx_execute(acct->handle, NULL, buf, count, NULL);
+	}
+	acct->count = 0;
+	acct->last = 0;
+}
+
+static void vfsx_usage_timer(struct tevent_context *ev, struct tevent_timer *te,
+			     struct timeval now, void *private_data)
+{
+	struct vfsx_accounting *acct = (struct vfsx_accounting *)private_data;
+
+	// tevent frees the timer once it has fired
+	acct->timer = NULL;
+	vfsx_usage_send(acct);
+}
+
+/* The counters of user uid, or NULL when usage is not counted */
+static struct vfsx_usage *vfsx_usage_get(vfs_handle_struct *handle, uid_t uid)
+{
+	struct vfsx_config *config;
+	struct vfsx_accounting *acct;
+	struct vfsx_usage *u;
+	unsigned int i;
+
+	SMB_VFS_HANDLE_GET_DATA(handle, config, struct vfsx_config, return NULL);
+	acct = config->accounting;
+	if (acct == NULL) {
+		return NULL;
+	}
+
+	// A process mostly serves one user, so the last one is checked first.
+	if (acct->count > 0 && acct->users[acct->last].uid == uid) {
+		return &acct->users[acct->last];
+	}
+	for (i = 0; i < acct->count; i++) {
+		if (acct->users[i].uid == uid) {
+			acct->last = i;
+			return &acct->users[i];
+		}
+	}
+
+	if (acct->count == VFSX_USAGE_USERS) {
+		vfsx_usage_send(acct);
+	}
+	if (acct->count == 0) {
+		acct->start = vfsx_now_usec();
+		acct->timer = tevent_add_timer(acct->ev, acct, timeval_current_ofs_usec(acct->interval_usec),
+					       vfsx_usage_timer, acct);
+	}
+	u = &acct->users[acct->count];
+	memset(u, 0, sizeof(*u));
+	u->uid = uid;
+	acct->last = acct->count++;
+	return u;
+}
+
+/* Counts a read or write of user uid and tells whether its event is to be sent */
+static bool vfsx_io_as(vfs_handle_struct *handle, files_struct *fsp, uid_t uid, ssize_t result, bool written)
+{
+	struct vfsx_config *config;
+	struct vfsx_usage *u;
+
+	if (result < 0) {
+		return false;
+	}
+	u = vfsx_usage_get(handle, uid);
+	if (u != NULL && written) {
+		u->writes++;
+		u->bytes_written += result;
+	}
+	else if (u != NULL) {
+		u->reads++;
+		u->bytes_read += result;
+	}
+	SMB_VFS_HANDLE_GET_DATA(handle, config, struct vfsx_config, return false);
+	return config->io_events && vfsx_wanted(handle, fsp->fsp_name->base_name);
+}
+
+static bool vfsx_io(vfs_handle_struct *handle, files_struct *fsp, ssize_t result, bool written)
+{
+	return vfsx_io_as(handle, fsp, get_current_uid(handle->conn), result, written);
+}
+
+static void vfsx_free_config(void **data)
+{
+	struct vfsx_config *config = (struct vfsx_config *)*data;
+
+	if (config->trace_fd != -1) {
+		close(config->trace_fd);
+	}
+	if (config->journal != NULL) {
+		vfsx_journal_flush(config->journal);
+		close(config->journal->fd);
+	}
+	TALLOC_FREE(*data);
+}
+
+static struct vfsx_config *vfsx_load_config(vfs_handle_struct *handle)
+{
+	struct vfsx_config *config;
+	const char *trace_file;
+	const char *journal_file;
+	uint32_t usage_usec;
+	int snum = SNUM(handle->conn);
+
+	config = talloc_zero(handle->conn, struct vfsx_config);
+	if (config == NULL) {
+		return NULL;
+	}
+	config->trace_fd = -1;
+
+	trace_file = lp_parm_const_string(snum, "vfsx", "trace file", NULL);
+	if (trace_file != NULL && *trace_file != '\0') {
+		config->trace_fd = vfsx_log_open(trace_file, VFSX_TRACE_MAGIC);
+	}
+
+	journal_file = lp_parm_const_string(snum, "vfsx", "journal file", NULL);
+	if (journal_file != NULL && *journal_file != '\0') {
+		config->journal = vfsx_journal_open(config, handle->conn, journal_file,
+						    lp_parm_ulong(snum, "vfsx", "journal flush usec", 1000000));
+	}
+
+	// One link serves every share of the process, so its mode and its ring
+	// of held events can't differ between shares.
+	config->slo_usec = lp_parm_ulong(GLOBAL_SECTION_SNUM, "vfsx", "slo usec", 0);
+	config->slo_timeout_usec = lp_parm_ulong(GLOBAL_SECTION_SNUM, "vfsx", "slo timeout usec", 4 * config->slo_usec);
+	config->slo_percentile = lp_parm_int(GLOBAL_SECTION_SNUM, "vfsx", "slo percentile", 99);
+	config->sample_rate = lp_parm_int(GLOBAL_SECTION_SNUM, "vfsx", "sample rate", 10);
+	if (config->slo_percentile < 1 || config->slo_percentile > 99) {
+		config->slo_percentile = 99;
+	}
+	if (config->sample_rate < 1) {
+		config->sample_rate = 1;
+	}
+	config->hold_max = lp_parm_ulong(GLOBAL_SECTION_SNUM, "vfsx", "reconnect buffer", VFSX_HOLD_MAX);
+	// Sequence numbers count the events of the whole process.
+	config->event_info = lp_parm_bool(GLOBAL_SECTION_SNUM, "vfsx", "event info", false);
+
+	usage_usec = lp_parm_ulong(snum, "vfsx", "usage interval usec", 0);
+	if (usage_usec != 0) {
+		config->accounting = vfsx_accounting_open(config, handle, usage_usec);
+	}
+	config->io_events = lp_parm_bool(snum, "vfsx", "io events", true);
+
+	config->connectpath = talloc_strdup(config, handle->conn->connectpath);
+	config->include = vfsx_trie_compile(config, lp_parm_string_list(snum, "vfsx", "include", NULL));
+	config->exclude = vfsx_trie_compile(config, lp_parm_string_list(snum, "vfsx", "exclude", NULL));
+	if (config->connectpath == NULL) {
+		TALLOC_FREE(config);
 	}
+	return config;
 }
 
 /* VFS handler functions */
 
 static int vfsx_connect(vfs_handle_struct *handle, const char *svc, const char *user)
 {
+	struct vfsx_config *config;
 	int result = -1;
 	int count;
 	char buf[VFSX_MSG_OUT_SIZE];
 
 	count = snprintf(buf, VFSX_MSG_OUT_SIZE, "connect:%s:", handle->conn->origpath);
 	result = SMB_VFS_NEXT_CONNECT(handle, svc, user);
-	if (result >= 0 ) vfsx_execute(buf, count);
+	if (result < 0) {
+		return result;
+	}
+	config = vfsx_load_config(handle);
+	if (config == NULL) {
+		SMB_VFS_NEXT_DISCONNECT(handle);
+		errno = ENOMEM;
+		return -1;
+	}
+	SMB_VFS_HANDLE_SET_DATA(handle, config, vfsx_free_config, struct vfsx_config, return -1);
+	vfsx_execute(handle, NULL, buf, count, NULL);
 	return result;
 }
 
 static void vfsx_disconnect(vfs_handle_struct *handle)
 {
+	struct vfsx_config *config;
+	const struct vfsx_link_stats *stats = &vfsx_link.stats;
 	int count;
 	char buf[VFSX_MSG_OUT_SIZE];
 
-	count = snprintf(buf, VFSX_MSG_OUT_SIZE, "disconnect:%s:", handle->conn->origpath);
 	SMB_VFS_NEXT_DISCONNECT(handle);
-	vfsx_execute(buf, count);
+	SMB_VFS_HANDLE_GET_DATA(handle, config, struct vfsx_config, return);
+	if (config->accounting != NULL) {
+		vfsx_usage_send(config->accounting);
+	}
+	if (config->slo_usec != 0) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "stats:%s:%s,%llu,%llu,%llu,%llu,%llu,%llu:",
+				 handle->conn->origpath, vfsx_level_names[vfsx_link.level],
+				 (unsigned long long)stats->degraded, (unsigned long long)stats->recovered,
+				 (unsigned long long)stats->sampled_out, (unsigned long long)stats->bypassed,
+				 (unsigned long long)stats->dropped, (unsigned long long)stats->timeouts);
+		vfsx_execute(handle, NULL, buf, count, NULL);
+	}
+	count = snprintf(buf, VFSX_MSG_OUT_SIZE, "disconnect:%s:", handle->conn->origpath);
+	vfsx_execute(handle, NULL, buf, count, NULL);
+	if (config->journal != NULL) {
+		vfsx_journal_flush(config->journal);
+	}
 }
 
 static DIR *vfsx_opendir(vfs_handle_struct *handle, const char *fname, const char *mask, uint32_t attr)
@@ -183,9 +1726,11 @@ static DIR *vfsx_opendir(vfs_handle_struct *handle, const char *fname, const cha
 	int count;
 	char buf[VFSX_MSG_OUT_SIZE];
 
-	count = snprintf(buf, VFSX_MSG_OUT_SIZE, "opendir:%s:%s:", handle->conn->origpath, fname);
 	result = SMB_VFS_NEXT_OPENDIR(handle, fname, mask, attr);
-	if (result >= 0) vfsx_execute(buf, count);
+	if (result >= 0 && vfsx_wanted(handle, fname)) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "opendir:%s:%s:", handle->conn->origpath, fname);
+		vfsx_execute(handle, NULL, buf, count, NULL);
+	}
 	return result;
 }
 
@@ -195,9 +1740,14 @@ static int vfsx_mkdir(vfs_handle_struct *handle, const char *path, mode_t mode)
 	int count;
 	char buf[VFSX_MSG_OUT_SIZE];
 
-	count = snprintf(buf, VFSX_MSG_OUT_SIZE, "mkdir:%s:%s,%d:", handle->conn->origpath, path, mode);
 	result = SMB_VFS_NEXT_MKDIR(handle, path, mode);
-	if (result >= 0) vfsx_execute(buf, count);
+	if (result >= 0) {
+		vfsx_journal_mark(handle, VFSX_CHANGE_CREATE, path, NULL);
+	}
+	if (result >= 0 && vfsx_wanted(handle, path)) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "mkdir:%s:%s,%d:", handle->conn->origpath, path, mode);
+		vfsx_execute(handle, NULL, buf, count, NULL);
+	}
 	return result;
 }
 
@@ -207,9 +1757,14 @@ static int vfsx_rmdir(vfs_handle_struct *handle, const char *path)
 	int count;
 	char buf[VFSX_MSG_OUT_SIZE];
 
-	count = snprintf(buf, VFSX_MSG_OUT_SIZE, "rmdir:%s:%s:", handle->conn->origpath, path);
 	result = SMB_VFS_NEXT_RMDIR(handle, path);
-	if (result >= 0) vfsx_execute(buf, count);
+	if (result >= 0) {
+		vfsx_journal_mark(handle, VFSX_CHANGE_DELETE, path, NULL);
+	}
+	if (result >= 0 && vfsx_wanted(handle, path)) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "rmdir:%s:%s:", handle->conn->origpath, path);
+		vfsx_execute(handle, NULL, buf, count, NULL);
+	}
 	return result;
 }
 
@@ -218,10 +1773,19 @@ static int vfsx_open(vfs_handle_struct *handle, struct smb_filename *fname, file
 	int result = -1;
 	int count;
 	char buf[VFSX_MSG_OUT_SIZE];
+	struct file_id id;
+	struct vfsx_hints hints = { .count = 0 };
+	struct vfsx_usage *usage;
 
-	count = snprintf(buf, VFSX_MSG_OUT_SIZE, "open:%s:%s,%d,%d:", handle->conn->origpath, fname->base_name, flags, mode);
 	result = SMB_VFS_NEXT_OPEN(handle, fname, fsp, flags, mode);
-	if (result >= 0) vfsx_execute(buf, count);
+	if (result >= 0 && (usage = vfsx_usage_get(handle, get_current_uid(handle->conn))) != NULL) {
+		usage->opens++;
+	}
+	if (result >= 0 && vfsx_wanted(handle, fname->base_name)) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "open:%s:%s,%d,%d:", handle->conn->origpath, fname->base_name, flags, mode);
+		vfsx_execute(handle, vfsx_open_key(handle, result, &fname->st, &id), buf, count, &hints);
+		vfsx_apply_hints(handle, fsp, result, &hints);
+	}
 	return result;
 }
 
@@ -230,10 +1794,22 @@ static int vfsx_close(vfs_handle_struct *handle, files_struct *fsp)
 	int result = -1;
 	int count;
 	char buf[VFSX_MSG_OUT_SIZE];
+	struct vfsx_fsp *ext;
 
-	count = snprintf(buf, VFSX_MSG_OUT_SIZE, "close:%s:%s:", fsp->conn->origpath, fsp->fsp_name->base_name);
+	// Streamed files leave no pages behind in the cache.
+	ext = VFS_FETCH_FSP_EXTENSION(handle, fsp);
+	if (ext != NULL && ext->noreuse && fsp->fh->fd != -1) {
+		vfsx_fadvise(fsp->fh->fd, 0, 0, VFSX_HINT_DONTNEED);
+	}
 	result = SMB_VFS_NEXT_CLOSE(handle, fsp);
-	if (result >= 0) vfsx_execute(buf, count);
+	// Smbd flags every written file, also through paths not hooked here.
+	if (fsp->modified) {
+		vfsx_journal_mark(handle, VFSX_CHANGE_DATA, fsp->fsp_name->base_name, NULL);
+	}
+	if (result >= 0 && vfsx_wanted(handle, fsp->fsp_name->base_name)) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "close:%s:%s:", fsp->conn->origpath, fsp->fsp_name->base_name);
+		vfsx_execute(handle, &fsp->file_id, buf, count, NULL);
+	}
 	return result;
 }
 
@@ -257,18 +1833,37 @@ static NTSTATUS vfsx_createfile( vfs_handle_struct *handle,
 				    const struct smb2_create_blobs *in_context_blobs,
 				    struct smb2_create_blobs *out_context_blobs)
 {
+    NTSTATUS status;
     int count;
     char buf[VFSX_MSG_OUT_SIZE];
+    struct vfsx_hints hints = { .count = 0 };
+    struct vfsx_usage *usage;
 
-    count = snprintf(buf, VFSX_MSG_OUT_SIZE, "create:%s:%s:", handle->conn->origpath, smb_fname->base_name);
-    vfsx_execute(buf, count);
-    return create_file_default(handle->conn, req, root_dir_fid, smb_fname,
+    status = create_file_default(handle->conn, req, root_dir_fid, smb_fname,
 				   access_mask, share_access,
 				   create_disposition, create_options,
 				   file_attributes, oplock_request, lease,
 				   allocation_size, private_flags,
 				   sd, ea_list, result,
 				   pinfo, in_context_blobs, out_context_blobs);
+    if (NT_STATUS_IS_OK(status) && pinfo != NULL) {
+        if (*pinfo == FILE_WAS_CREATED) {
+            vfsx_journal_mark(handle, VFSX_CHANGE_CREATE, smb_fname->base_name, NULL);
+            if ((usage = vfsx_usage_get(handle, get_current_uid(handle->conn))) != NULL) {
+                usage->creates++;
+            }
+        }
+        else if (*pinfo == FILE_WAS_OVERWRITTEN || *pinfo == FILE_WAS_SUPERSEDED) {
+            vfsx_journal_mark(handle, VFSX_CHANGE_DATA, smb_fname->base_name, NULL);
+        }
+    }
+    // Sent once the file exists, so the event carries its file id.
+    if (NT_STATUS_IS_OK(status) && vfsx_wanted(handle, smb_fname->base_name)) {
+        count = snprintf(buf, VFSX_MSG_OUT_SIZE, "create:%s:%s:", handle->conn->origpath, smb_fname->base_name);
+        vfsx_execute(handle, &(*result)->file_id, buf, count, &hints);
+        vfsx_apply_hints(handle, *result, (*result)->fh->fd, &hints);
+    }
+    return status;
 	/*
     return SMB_VFS_NEXT_CREATE_FILE(handle->conn, req, root_dir_fid, smb_fname,
 				   access_mask, share_access,
@@ -286,9 +1881,14 @@ static int vfsx_mknod(vfs_handle_struct *handle,  const char *path, mode_t mode,
 	int count;
 	char buf[VFSX_MSG_OUT_SIZE];
 
-	count = snprintf(buf, VFSX_MSG_OUT_SIZE, "create:%s:%s:", handle->conn->origpath, path);
 	result = SMB_VFS_NEXT_MKNOD(handle, path, mode, dev);
-	if (result >= 0) vfsx_execute(buf, count);
+	if (result >= 0) {
+		vfsx_journal_mark(handle, VFSX_CHANGE_CREATE, path, NULL);
+	}
+	if (result >= 0 && vfsx_wanted(handle, path)) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "create:%s:%s:", handle->conn->origpath, path);
+		vfsx_execute(handle, NULL, buf, count, NULL);
+	}
 	return result;
 }
 
@@ -298,9 +1898,11 @@ static ssize_t vfsx_read(vfs_handle_struct *handle, files_struct *fsp, void *dat
 	int count;
 	char buf[VFSX_MSG_OUT_SIZE];
 
-	count = snprintf(buf, VFSX_MSG_OUT_SIZE, "read:%s:%s:", fsp->conn->origpath, fsp->fsp_name->base_name);
 	result = SMB_VFS_NEXT_READ(handle, fsp, data, n);
-	if (result >= 0) vfsx_execute(buf, count);
+	if (vfsx_io(handle, fsp, result, false)) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "read:%s:%s:", fsp->conn->origpath, fsp->fsp_name->base_name);
+		vfsx_execute(handle, &fsp->file_id, buf, count, NULL);
+	}
 	return result;
 }
 
@@ -310,9 +1912,14 @@ static ssize_t vfsx_write(vfs_handle_struct *handle, files_struct *fsp, const vo
 	int count;
 	char buf[VFSX_MSG_OUT_SIZE];
 
-	count = snprintf(buf, VFSX_MSG_OUT_SIZE, "write:%s:%s:", fsp->conn->origpath, fsp->fsp_name->base_name);
 	result = SMB_VFS_NEXT_WRITE(handle, fsp, data, n);
-	if (result >= 0) vfsx_execute(buf, count);
+	if (result > 0) {
+		vfsx_journal_mark(handle, VFSX_CHANGE_DATA, fsp->fsp_name->base_name, NULL);
+	}
+	if (vfsx_io(handle, fsp, result, true)) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "write:%s:%s:", fsp->conn->origpath, fsp->fsp_name->base_name);
+		vfsx_execute(handle, &fsp->file_id, buf, count, NULL);
+	}
 	return result;
 }
 
@@ -322,9 +1929,11 @@ static ssize_t vfsx_pread(vfs_handle_struct *handle, files_struct *fsp, void *da
 	int count;
 	char buf[VFSX_MSG_OUT_SIZE];
 
-	count = snprintf(buf, VFSX_MSG_OUT_SIZE, "pread:%s:%s:", fsp->conn->origpath, fsp->fsp_name->base_name);
 	result = SMB_VFS_NEXT_PREAD(handle, fsp, data, n, offset);
-	if (result >= 0) vfsx_execute(buf, count);
+	if (vfsx_io(handle, fsp, result, false)) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "pread:%s:%s:", fsp->conn->origpath, fsp->fsp_name->base_name);
+		vfsx_execute(handle, &fsp->file_id, buf, count, NULL);
+	}
 	return result;
 }
 
@@ -334,9 +1943,161 @@ static ssize_t vfsx_pwrite(vfs_handle_struct *handle, files_struct *fsp, const v
 	int count;
 	char buf[VFSX_MSG_OUT_SIZE];
 
-	count = snprintf(buf, VFSX_MSG_OUT_SIZE, "pwrite:%s:%s:", fsp->conn->origpath, fsp->fsp_name->base_name);
 	result = SMB_VFS_NEXT_PWRITE(handle, fsp, data, n, offset);
-	if (result >= 0) vfsx_execute(buf, count);
+	if (result > 0) {
+		vfsx_journal_mark(handle, VFSX_CHANGE_DATA, fsp->fsp_name->base_name, NULL);
+	}
+	if (vfsx_io(handle, fsp, result, true)) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "pwrite:%s:%s:", fsp->conn->origpath, fsp->fsp_name->base_name);
+		vfsx_execute(handle, &fsp->file_id, buf, count, NULL);
+	}
+	return result;
+}
+
+/*
+ * SMB2 reads and writes go through the async path, and may bypass pread and
+ * pwrite entirely.  They complete as another user may be current, so the
+ * issuing user is kept for the accounting.
+ */
+
+struct vfsx_aio_state {
+	vfs_handle_struct *handle;
+	files_struct *fsp;
+	uid_t uid;
+	ssize_t ret;
+	int err;
+};
+
+static void vfsx_aio_done(struct vfsx_aio_state *state, bool written)
+{
+	files_struct *fsp = state->fsp;
+	int count;
+	char buf[VFSX_MSG_OUT_SIZE];
+
+	if (written && state->ret > 0) {
+		vfsx_journal_mark(state->handle, VFSX_CHANGE_DATA, fsp->fsp_name->base_name, NULL);
+	}
+	if (vfsx_io_as(state->handle, fsp, state->uid, state->ret, written)) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "%s:%s:%s:", written ? "pwrite" : "pread",
+				 fsp->conn->origpath, fsp->fsp_name->base_name);
+		vfsx_execute(state->handle, &fsp->file_id, buf, count, NULL);
+	}
+}
+
+static void vfsx_pread_done(struct tevent_req *subreq);
+
+static struct tevent_req *vfsx_pread_send(vfs_handle_struct *handle, TALLOC_CTX *mem_ctx,
+					  struct tevent_context *ev, files_struct *fsp,
+					  void *data, size_t n, off_t offset)
+{
+	struct tevent_req *req, *subreq;
+	struct vfsx_aio_state *state;
+
+	req = tevent_req_create(mem_ctx, &state, struct vfsx_aio_state);
+	if (req == NULL) {
+		return NULL;
+	}
+	state->handle = handle;
+	state->fsp = fsp;
+	state->uid = get_current_uid(handle->conn);
+
+	subreq = SMB_VFS_NEXT_PREAD_SEND(state, ev, handle, fsp, data, n, offset);
+	if (tevent_req_nomem(subreq, req)) {
+		return tevent_req_post(req, ev);
+	}
+	tevent_req_set_callback(subreq, vfsx_pread_done, req);
+	return req;
+}
+
+static void vfsx_pread_done(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct vfsx_aio_state *state = tevent_req_data(req, struct vfsx_aio_state);
+
+	state->ret = SMB_VFS_PREAD_RECV(subreq, &state->err);
+	TALLOC_FREE(subreq);
+	vfsx_aio_done(state, false);
+	tevent_req_done(req);
+}
+
+static void vfsx_pwrite_done(struct tevent_req *subreq);
+
+static struct tevent_req *vfsx_pwrite_send(vfs_handle_struct *handle, TALLOC_CTX *mem_ctx,
+					   struct tevent_context *ev, files_struct *fsp,
+					   const void *data, size_t n, off_t offset)
+{
+	struct tevent_req *req, *subreq;
+	struct vfsx_aio_state *state;
+
+	req = tevent_req_create(mem_ctx, &state, struct vfsx_aio_state);
+	if (req == NULL) {
+		return NULL;
+	}
+	state->handle = handle;
+	state->fsp = fsp;
+	state->uid = get_current_uid(handle->conn);
+
+	subreq = SMB_VFS_NEXT_PWRITE_SEND(state, ev, handle, fsp, data, n, offset);
+	if (tevent_req_nomem(subreq, req)) {
+		return tevent_req_post(req, ev);
+	}
+	tevent_req_set_callback(subreq, vfsx_pwrite_done, req);
+	return req;
+}
+
+static void vfsx_pwrite_done(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(subreq, struct tevent_req);
+	struct vfsx_aio_state *state = tevent_req_data(req, struct vfsx_aio_state);
+
+	state->ret = SMB_VFS_PWRITE_RECV(subreq, &state->err);
+	TALLOC_FREE(subreq);
+	vfsx_aio_done(state, true);
+	tevent_req_done(req);
+}
+
+static ssize_t vfsx_aio_recv(struct tevent_req *req, int *err)
+{
+	struct vfsx_aio_state *state = tevent_req_data(req, struct vfsx_aio_state);
+
+	if (tevent_req_is_unix_error(req, err)) {
+		return -1;
+	}
+	*err = state->err;
+	return state->ret;
+}
+
+static ssize_t vfsx_sendfile(vfs_handle_struct *handle, int tofd, files_struct *fromfsp,
+			     const DATA_BLOB *hdr, off_t offset, size_t n)
+{
+	ssize_t result;
+	ssize_t hdr_len = hdr != NULL ? hdr->length : 0;
+	int count;
+	char buf[VFSX_MSG_OUT_SIZE];
+
+	// The result includes the header smbd sends ahead of the file data.
+	result = SMB_VFS_NEXT_SENDFILE(handle, tofd, fromfsp, hdr, offset, n);
+	if (vfsx_io(handle, fromfsp, result - hdr_len, false)) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "pread:%s:%s:", fromfsp->conn->origpath, fromfsp->fsp_name->base_name);
+		vfsx_execute(handle, &fromfsp->file_id, buf, count, NULL);
+	}
+	return result;
+}
+
+static ssize_t vfsx_recvfile(vfs_handle_struct *handle, int fromfd, files_struct *tofsp, off_t offset, size_t n)
+{
+	ssize_t result;
+	int count;
+	char buf[VFSX_MSG_OUT_SIZE];
+
+	result = SMB_VFS_NEXT_RECVFILE(handle, fromfd, tofsp, offset, n);
+	if (result > 0) {
+		vfsx_journal_mark(handle, VFSX_CHANGE_DATA, tofsp->fsp_name->base_name, NULL);
+	}
+	if (vfsx_io(handle, tofsp, result, true)) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "pwrite:%s:%s:", tofsp->conn->origpath, tofsp->fsp_name->base_name);
+		vfsx_execute(handle, &tofsp->file_id, buf, count, NULL);
+	}
 	return result;
 }
 
@@ -346,9 +2107,11 @@ static off_t vfsx_lseek(vfs_handle_struct *handle, files_struct *fsp, off_t offs
 	int count;
 	char buf[VFSX_MSG_OUT_SIZE];
 
-	count = snprintf(buf, VFSX_MSG_OUT_SIZE, "lseek:%s:%s:", fsp->conn->origpath, fsp->fsp_name->base_name);
 	result = SMB_VFS_NEXT_LSEEK(handle, fsp, offset, whence);
-	if (result >= 0) vfsx_execute(buf, count);
+	if (result >= 0 && vfsx_wanted(handle, fsp->fsp_name->base_name)) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "lseek:%s:%s:", fsp->conn->origpath, fsp->fsp_name->base_name);
+		vfsx_execute(handle, &fsp->file_id, buf, count, NULL);
+	}
 	return result;
 }
 
@@ -359,10 +2122,16 @@ static int vfsx_rename(vfs_handle_struct *handle,
 	int result = -1;
 	int count;
 	char buf[VFSX_MSG_OUT_SIZE];
+	struct file_id id;
 
-	count = snprintf(buf, VFSX_MSG_OUT_SIZE, "rename:%s:%s,%s:", handle->conn->origpath, old->base_name, new->base_name);
 	result = SMB_VFS_NEXT_RENAME(handle, old, new);
-	if (result >= 0) vfsx_execute(buf, count);
+	if (result >= 0) {
+		vfsx_journal_mark(handle, VFSX_CHANGE_RENAME, old->base_name, new->base_name);
+	}
+	if (result >= 0 && (vfsx_wanted(handle, old->base_name) || vfsx_wanted(handle, new->base_name))) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "rename:%s:%s,%s:", handle->conn->origpath, old->base_name, new->base_name);
+		vfsx_execute(handle, vfsx_stat_key(handle, &old->st, &id), buf, count, NULL);
+	}
 	return result;
 }
 
@@ -371,10 +2140,74 @@ static int vfsx_unlink(vfs_handle_struct *handle, const struct smb_filename *pat
 	int result = -1;
 	int count;
 	char buf[VFSX_MSG_OUT_SIZE];
+	struct file_id id;
 
-	count = snprintf(buf, VFSX_MSG_OUT_SIZE, "unlink:%s:%s:", handle->conn->origpath, path->base_name);
 	result = SMB_VFS_NEXT_UNLINK(handle, path);
-	if (result >= 0) vfsx_execute(buf, count);
+	if (result >= 0) {
+		vfsx_journal_mark(handle, VFSX_CHANGE_DELETE, path->base_name, NULL);
+	}
+	if (result >= 0 && vfsx_wanted(handle, path->base_name)) {
+		count = snprintf(buf, VFSX_MSG_OUT_SIZE, "unlink:%s:%s:", handle->conn->origpath, path->base_name);
+		vfsx_execute(handle, vfsx_stat_key(handle, &path->st, &id), buf, count, NULL);
+	}
+	return result;
+}
+
+/* Mutators that are only recorded in the change journal */
+
+static int vfsx_ftruncate(vfs_handle_struct *handle, files_struct *fsp, off_t offset)
+{
+	int result;
+
+	result = SMB_VFS_NEXT_FTRUNCATE(handle, fsp, offset);
+	if (result >= 0) {
+		vfsx_journal_mark(handle, VFSX_CHANGE_DATA, fsp->fsp_name->base_name, NULL);
+	}
+	return result;
+}
+
+static int vfsx_fallocate(vfs_handle_struct *handle, files_struct *fsp, uint32_t mode, off_t offset, off_t len)
+{
+	int result;
+
+	result = SMB_VFS_NEXT_FALLOCATE(handle, fsp, mode, offset, len);
+	if (result >= 0) {
+		vfsx_journal_mark(handle, VFSX_CHANGE_DATA, fsp->fsp_name->base_name, NULL);
+	}
+	return result;
+}
+
+static int vfsx_ntimes(vfs_handle_struct *handle, const struct smb_filename *smb_fname, struct smb_file_time *ft)
+{
+	int result;
+
+	result = SMB_VFS_NEXT_NTIMES(handle, smb_fname, ft);
+	if (result >= 0) {
+		vfsx_journal_mark(handle, VFSX_CHANGE_META, smb_fname->base_name, NULL);
+	}
+	return result;
+}
+
+static int vfsx_fsetxattr(vfs_handle_struct *handle, files_struct *fsp, const char *name,
+			  const void *value, size_t size, int flags)
+{
+	int result;
+
+	result = SMB_VFS_NEXT_FSETXATTR(handle, fsp, name, value, size, flags);
+	if (result >= 0) {
+		vfsx_journal_mark(handle, VFSX_CHANGE_META, fsp->fsp_name->base_name, NULL);
+	}
+	return result;
+}
+
+static int vfsx_fsync(vfs_handle_struct *handle, files_struct *fsp)
+{
+	int result;
+
+	result = SMB_VFS_NEXT_FSYNC(handle, fsp);
+	if (result >= 0) {
+		vfsx_journal_mark(handle, VFSX_CHANGE_DATA, fsp->fsp_name->base_name, NULL);
+	}
 	return result;
 }
 
@@ -434,9 +2267,20 @@ struct vfs_fn_pointers vfsx_fns = {
     .write_fn = vfsx_write,
     .pread_fn = vfsx_pread,
     .pwrite_fn = vfsx_pwrite,
+    .pread_send_fn = vfsx_pread_send,
+    .pread_recv_fn = vfsx_aio_recv,
+    .pwrite_send_fn = vfsx_pwrite_send,
+    .pwrite_recv_fn = vfsx_aio_recv,
+    .sendfile_fn = vfsx_sendfile,
+    .recvfile_fn = vfsx_recvfile,
     .lseek_fn = vfsx_lseek,
     .rename_fn = vfsx_rename,
     .unlink_fn = vfsx_unlink,
+    .ftruncate_fn = vfsx_ftruncate,
+    .fallocate_fn = vfsx_fallocate,
+    .ntimes_fn = vfsx_ntimes,
+    .fsetxattr_fn = vfsx_fsetxattr,
+    .fsync_fn = vfsx_fsync,
 };
 
 